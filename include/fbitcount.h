@@ -0,0 +1,170 @@
+#ifndef FBITCOUNT_H
+#define FBITCOUNT_H
+
+#include <stdint.h>
+#include "flavori.h"
+#include "fbitops.h"
+
+// Counting (dry run) output bitstream.
+//
+// Takes the same put calls as an output QBitstream but only adds up the bits they would write:
+// there is no buffer and no device, so serializing a structure through it measures its size
+// (for length fields that precede the payload) at the cost of the field arithmetic alone.
+// QBitcount is final, so writers compiled against it directly inline to a few additions.
+// Input calls fail with E_READ_FAILED.
+class QBitcount final : public IBitstream
+{
+public:
+    QBitcount() : _bits(0), err_code(E_NONE) {}
+
+    // get mode
+    Bitstream_t getmode() { return BS_OUTPUT; }
+    bool isWriteable() { return true; }
+    bool isReadable() { return false; }
+
+    // bits counted so far, and the whole bytes they take
+    uint64_t bits() const { return _bits; }
+    uint64_t bytes() const { return (_bits + 7) >> 3; }
+
+    // start over
+    void reset() { _bits = 0; err_code = E_NONE; }
+
+    inline int geterror(void) { return err_code; }
+
+    // put
+    int putbits(uint64_t value, int n) { _bits += n; return value; }
+    float putfloat(float value) { _bits += 32; return value; }
+    double putdouble(double value) { _bits += 64; return value; }
+    long double putldouble(double value) { return putdouble(value); }
+
+    int little_putbits(uint64_t value, int n) { _bits += n; return value; }
+    float little_putfloat(float value) { _bits += 32; return value; }
+    double little_putdouble(double value) { _bits += 64; return value; }
+    long double little_putldouble(double value) { return little_putdouble(value); }
+
+    uint64_t putBuffer(uint8_t * /* buffer */, uint64_t size) { _bits += size << 3; return size; }
+
+    // Exp-Golomb codes, see QBitstream::putbits_expgolomb()
+    int putbits_expgolomb(uint64_t value, int32_t n)
+    {
+        uint64_t val = n < 64 ? value & ~(~0ULL << n) : value;
+        if (!(val + 1))
+        {
+            err_code = E_WRITE_FAILED;
+            return val;
+        }
+        _bits += 2 * (64 - flavor::clz64(val + 1)) - 1;
+        return val;
+    }
+
+    int putbits_sexpgolomb(uint64_t value, int32_t n)
+    {
+        int64_t v = (int64_t)value;
+        putbits_expgolomb(v > 0 ? 2 * (uint64_t)v - 1 : 0 - 2 * (uint64_t)v, n);
+        return value;
+    }
+
+    // arrays, see QBitstream::putbits_array() and putbits_expgolomb_array()
+    template <typename T>
+    uint64_t putbits_array(int width, uint64_t count, const T * /* in */) { _bits += (uint64_t)width * count; return count; }
+    template <typename T>
+    uint64_t little_putbits_array(int width, uint64_t count, const T * in) { return putbits_array(width, count, in); }
+
+    template <typename T>
+    uint64_t putbits_expgolomb_array(uint64_t count, const T * in, int32_t n = 64) { return expgolomb_array(count, in, n, false); }
+    template <typename T>
+    uint64_t putbits_sexpgolomb_array(uint64_t count, const T * in, int32_t n = 64) { return expgolomb_array(count, in, n, true); }
+
+    // skip next 'n' bits; n>=0
+    void skipbits(int n) { _bits += n; }
+
+    // align bitstream (n must be multiple of 8); returns bits skipped
+    int align(int n)
+    {
+        if (n % 8)
+        {
+            err_code = E_INVALID_ALIGNMENT;
+            return 0;
+        }
+        int s = (int)((n - _bits % n) % n);
+        _bits += s;
+        return s;
+    }
+
+    // output: aligns (alen > 0) and returns 0
+    uint64_t next(int /* n */, int /* big */, int /* sign */, int alen)
+    {
+        if (alen > 0) align(alen);
+        return 0;
+    }
+
+    // output: the bits up to the alen-bit boundary
+    uint64_t nextcode(uint64_t /* code */, int /* n */, int alen) { return alen > 0 ? align(alen) : 0; }
+
+    // the zero padding of QBitstream::flushbits()
+    void flushbits() { _bits = (_bits + 7) & ~7ULL; }
+
+    uint64_t getpos(void) { return _bits; }
+
+    // there is nothing to seek in
+    bool canSeek() { return false; }
+    void seek(int64_t /* pos */) { err_code = E_SEEK_FAILED; }
+    int64_t tell() { return -1; }
+    bool eof() { return false; }
+
+    // input
+    uint64_t nextbits(int32_t /* n */) { return fail(); }
+    uint64_t snextbits(int32_t /* n */) { return fail(); }
+    uint64_t getbits(int32_t /* n */) { return fail(); }
+    uint64_t sgetbits(int32_t /* n */) { return fail(); }
+    float nextfloat(void) { return fail(); }
+    float getfloat(void) { return fail(); }
+    double nextdouble(void) { return fail(); }
+    double getdouble(void) { return fail(); }
+    long double nextldouble(void) { return fail(); }
+    long double getldouble(void) { return fail(); }
+    uint64_t getBuffer(uint8_t * /* buffer */, uint64_t /* size */) { return fail(); }
+
+    uint64_t little_nextbits(int32_t /* n */) { return fail(); }
+    uint64_t little_snextbits(int32_t /* n */) { return fail(); }
+    uint64_t little_getbits(int32_t /* n */) { return fail(); }
+    uint64_t little_sgetbits(int32_t /* n */) { return fail(); }
+    float little_nextfloat(void) { return fail(); }
+    float little_getfloat(void) { return fail(); }
+    double little_nextdouble(void) { return fail(); }
+    double little_getdouble(void) { return fail(); }
+    long double little_nextldouble(void) { return fail(); }
+    long double little_getldouble(void) { return fail(); }
+
+    uint64_t nextbits_expgolomb(int32_t /* n */) { return fail(); }
+    uint64_t snextbits_expgolomb(int32_t /* n */) { return fail(); }
+    uint64_t getbits_expgolomb(int32_t /* n */) { return fail(); }
+    uint64_t sgetbits_expgolomb(int32_t /* n */) { return fail(); }
+
+private:
+    uint64_t _bits;         // bits put so far
+    Error_t err_code;
+
+    uint64_t fail() { err_code = E_READ_FAILED; return 0; }
+
+    template <typename T>
+    uint64_t expgolomb_array(uint64_t count, const T * in, int32_t n, bool sign)
+    {
+        uint64_t m = n < 64 ? ~(~0ULL << n) : ~0ULL;
+        for (uint64_t i = 0; i < count; i++)
+        {
+            uint64_t x = (uint64_t)in[i];
+            if (sign) x = (int64_t)x > 0 ? 2 * x - 1 : 0 - 2 * x;
+            uint64_t k = (x & m) + 1;
+            if (!k)
+            {
+                err_code = E_WRITE_FAILED;
+                return i;
+            }
+            _bits += 2 * (64 - flavor::clz64(k)) - 1;
+        }
+        return count;
+    }
+};
+
+#endif // FBITCOUNT_H
@@ -0,0 +1,142 @@
+#ifndef FBITOPS_H
+#define FBITOPS_H
+
+// Small bit manipulation helpers shared by the bitstream implementation.
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <stdlib.h>
+#include <intrin.h>
+#endif
+
+namespace flavor {
+
+// byte swaps
+inline uint16_t bswap16(uint16_t x)
+{
+#if defined(_MSC_VER)
+    return _byteswap_ushort(x);
+#else
+    return __builtin_bswap16(x);
+#endif
+}
+
+inline uint32_t bswap32(uint32_t x)
+{
+#if defined(_MSC_VER)
+    return _byteswap_ulong(x);
+#else
+    return __builtin_bswap32(x);
+#endif
+}
+
+inline uint64_t bswap64(uint64_t x)
+{
+#if defined(_MSC_VER)
+    return _byteswap_uint64(x);
+#else
+    return __builtin_bswap64(x);
+#endif
+}
+
+// count leading zero bits; x must not be 0
+inline int clz64(uint64_t x)
+{
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanReverse64(&i, x);
+    return 63 - (int)i;
+#else
+    return __builtin_clzll(x);
+#endif
+}
+
+// count trailing zero bits; x must not be 0
+inline int ctz32(uint32_t x)
+{
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (int)i;
+#else
+    return __builtin_ctz(x);
+#endif
+}
+
+// unaligned big endian load of 8 bytes
+inline uint64_t load_be64(const uint8_t * p)
+{
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    return x;
+#else
+    return bswap64(x);
+#endif
+}
+
+// unaligned big endian store of 8 bytes
+inline void store_be64(uint8_t * p, uint64_t x)
+{
+#if !(defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__))
+    x = bswap64(x);
+#endif
+    memcpy(p, &x, sizeof(x));
+}
+
+// unaligned big endian loads of 2 and 4 bytes
+inline uint16_t load_be16(const uint8_t * p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+inline uint32_t load_be32(const uint8_t * p)
+{
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    return x;
+#else
+    return bswap32(x);
+#endif
+}
+
+// unaligned little endian loads
+inline uint16_t load_le16(const uint8_t * p)
+{
+    uint16_t x;
+    memcpy(&x, p, sizeof(x));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    return bswap16(x);
+#else
+    return x;
+#endif
+}
+
+inline uint32_t load_le32(const uint8_t * p)
+{
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    return bswap32(x);
+#else
+    return x;
+#endif
+}
+
+inline uint64_t load_le64(const uint8_t * p)
+{
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    return bswap64(x);
+#else
+    return x;
+#endif
+}
+
+} // namespace flavor
+
+#endif // FBITOPS_H
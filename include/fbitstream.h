@@ -7,26 +7,72 @@
 #include <sstream>
 #include <iostream>
 #include <string>
+#include <iterator>
+#include <type_traits>
+#include <utility>
 #include <smallvector.h>
+#include "fbitops.h"
 
 void flerror(const char* fmt, ...);
 
-const int BS_BUF_LEN=1024;  // buffer size, in bytes
+namespace flavor {
+
+class ReadAhead;
+
+// containers that hold their data rather than view it: those that are not trivially copyable,
+// and those that are but have a fixed size (std::array)
+template <typename C, typename = void>
+struct owns_data : std::integral_constant<bool, !std::is_trivially_copyable<C>::value> {};
+template <typename C>
+struct owns_data<C, std::void_t<decltype(std::tuple_size<C>::value)>> : std::true_type {};
+
+}
+
+const int BS_BUF_LEN=1024;  // default buffer size, in bytes
+const int BS_BUF_PAD=16;    // zeroed slack past the end of the buffer, so word loads never overrun
+const int BS_DIRECT_ALIGN=4096; // O_DIRECT offset, size and memory alignment, in bytes
 
 // Bitstream class
-class QBitstream : public IBitstream
+//
+// QBitstream is final, so parsers compiled against QBitstream (rather than IBitstream) get
+// direct calls, and the read fast paths below inline into the caller.  The slow paths
+// (buffer refills, device I/O) stay in the library.
+class QBitstream final : public IBitstream
 {
 private:
     Bitstream_t _type;       // type of bitstream (input/output)
     std::istream * _input_device;
     std::ostream * _output_device;
+    int64_t _spos;          // stream offset after the buffer (input) or of buf[0] (output), so tell() needs no tellg()/tellp()
+    bool _sseek;            // the input stream is seekable
 
     flavor::SmallVector<uint8_t> * _vector;
     size_t _vpos;
+    bool _vdirect;          // vector output: buf is a window into the vector storage at _vpos
+
+    uint8_t * _map;         // memory input (mapped file or span), buf is a window into it (or NULL)
+    uint64_t _map_size;     // input size in bytes
+    uint64_t _map_len;      // size of a file mapping, including a page of zeros past the file (0 for a span)
+    uint64_t _map_pos;      // input offset of the first byte after the buffer window
+    flavor::SmallVector<uint8_t> _sbuf;     // padded copy of the end of a span (or of all of it, to unescape)
+
+    flavor::ReadAhead * _ra;    // reads the input device ahead on a helper thread (or NULL)
+
+    int _fd;                // POSIX file descriptor device (or -1)
+    bool _fd_seek;          // the descriptor is seekable, input uses pread()
+    bool _fd_direct;        // opened with O_DIRECT, device I/O goes through _dbuf in aligned blocks
+    int64_t _fd_pos;        // device offset of the next byte read or written
+    unsigned char * _dbuf;  // aligned block buffer for O_DIRECT (or NULL)
+    int _dbuf_size;         // its size, a multiple of BS_DIRECT_ALIGN
+    int _dbuf_off;          // input: offset of the next byte in it
+    int _dbuf_len;          // bytes in it
 
     bool        _ownDevice;
 
     unsigned char *buf;     // buffer
+    int _buf_size;          // buffer capacity in bytes
+    int _buf_max;           // capacity the buffer may grow to (see setBufferGrowth())
+    int _buf_fills;         // refills (or flushes) in a row that used the whole buffer
     int buf_len;		    // usable buffer size (for partially filled buffers)
     int cur_bit;            // current bit position in buf
     uint64_t tot_bits;      // total bits read/written
@@ -34,25 +80,169 @@ private:
 
     Error_t err_code;       // error code (useful when exceptions are not supported)
 
-    unsigned int _zcount;   // number of zeros counted on most recent _countZero
+    int _eglen;             // length in bits of the most recent Exp-Golomb code (0 if invalid)
+
+    uint64_t _cache;        // 64-bit big endian window of buf, starting at bit _cache_pos
+    int _cache_pos;         // bit position in buf of the first bit in _cache
+    int _cache_len;         // number of valid bits in _cache (less than 64 at the end of the buffer)
+
+    flavor::SmallVector<uint64_t> _marks;   // tot_bits of the outstanding mark()s (input) or
+                                            // checkpoint()s (output: of their first bit not in buf)
+    uint64_t _mark_bits;    // the oldest of them; the buffer keeps the bytes from there on
+
+    uint64_t _wacc;         // output bits not stored in buf yet, in the low _wbits bits
+    int _wbits;             // number of bits in _wacc (0..63); buf holds cur_bit - _wbits bits
+
+    bool _ep;               // remove (input) or insert (output) emulation prevention bytes (00 00 03)
+    int _ep_zeros;          // zero bytes at the end of the data seen or written so far (0..2)
+    uint64_t _ep_count;     // emulation prevention bytes removed or inserted
+    uint64_t _ep_rbsp;      // RBSP bytes buffered since the removal was enabled
+    uint64_t _ep_origin;    // position (as getpos()) where the removal was enabled
+    flavor::SmallVector<uint64_t> _ep_map;  // RBSP byte index following each removed byte
 private:
     // functions
+    void init(Bitstream_t type, bool ownDevice);    // the state shared by all constructors
     void fill_buf();        // fills buffer
     void flush_buf();       // flushes buffer
 
+    // keep the buffer from 'bits' (as tot_bits) on, until release(bits)
+    void hold(uint64_t bits);
+    void release(uint64_t bits);
+    void fill_map(int n);   // moves the window over memory input past the first 'n' bytes
+    void resize_buf(int size, int keep);    // new buffer of 'size' bytes, keeping the first 'keep' bytes
+
+    // invalidate the read cache (whenever the contents of buf change)
+    void invalidate_cache() { _cache_pos = 0x3fffffff; }
+
+    // reload the read cache at the current position and return the next 'n' bits
+    uint64_t refill_cache(int n);
+
+    // putbits() with a full buffer
+    int putbits_slow(uint64_t value, int n);
+
+    // offset of cur_bit in the read cache; huge (rather than negative) when cur_bit is before
+    // the cache, and wide enough that adding a bit count can not wrap
+    uint64_t cache_off() const { return (unsigned int)(cur_bit - _cache_pos); }
+
+    // sign extend an 'n' bit value (only if n>1)
+    static uint64_t sext(uint64_t x, int n)
+    {
+        return n > 1 ? (uint64_t)((int64_t)(x << (64 - n)) >> (64 - n)) : x;
+    }
+
+    template <int N>
+    static uint64_t sext(uint64_t x)
+    {
+        if (N > 1) return (uint64_t)((int64_t)(x << (64 - N)) >> (64 - N));
+        return x;
+    }
+
     // sets error code
     void seterror(Error_t err) { err_code=err; }
 
     // jl - count up to maxz zeros from the current bit position
     int _countZero(int maxz);
+
+    // Exp-Golomb decode for codes that do not fit the read cache
+    uint64_t expgolomb_slow(int n);
+
+    // byte aligned code search for nextcode(); false if the code/alignment needs the bitwise search
+    bool nextcode_bytes(uint64_t code, int n, int alen, uint64_t &s);
+
+    // remove the emulation prevention bytes from 'l' input bytes at 'p' in place; returns the new length
+    int ep_strip(uint8_t * p, int l);
+
+    // write 'l' bytes to the output device; false on a write error
+    bool write_out(const uint8_t * p, int64_t l);
+
+    // point buf at the vector storage from _vpos on, growing it as needed (direct vector output);
+    // the first 'held' bytes there are already in the vector
+    void vec_window(int held = 0);
+
+    // read up to 'n' bytes from the input device; short only at the end of the data, -1 on an error
+    int64_t dev_read(uint8_t * p, int64_t n);
+
+    // file descriptor I/O; fd_finish() writes the last partial O_DIRECT block, and with 'keep'
+    // leaves it in _dbuf (the descriptor back at its start) so that the output can go on
+    int64_t fd_read(uint8_t * p, int64_t n);
+    bool fd_write(const uint8_t * p, int64_t n);
+    void fd_finish(bool keep = false);
+
+    // write 'l' bytes to the output device, inserting emulation prevention bytes
+    bool ep_write(const uint8_t * p, int l);
+
+    // bit aligned (alen=0) code search for nextcode(); false if the code is too long for it
+    bool nextcode_bits(uint64_t code, int n, uint64_t &s);
+
+    // 'n' bits (1..64) at bit position 'pos' of buf, read directly from the buffer
+    uint64_t peekbits_at(int pos, int n)
+    {
+        const unsigned char *v = buf + (pos >> 3);
+        int off = pos & 7;
+        uint64_t x = flavor::load_be64(v) << off;
+
+        // more than 57 bits at an odd position, take the rest from the ninth byte
+        if (off + n > 64) x |= v[8] >> (8 - off);
+        return x >> (64 - n);
+    }
+
+    // bulk read of fixed width values, see getbits_array()
+    template <typename T>
+    uint64_t array_read(int width, uint64_t count, T * out, bool little, bool sign);
+
+    // bulk read of Exp-Golomb codes, see getbits_expgolomb_array()
+    template <typename T>
+    uint64_t expgolomb_array_read(uint64_t count, T * out, int n, bool sign);
+
+    // bulk writes, see putbits_array() and putbits_expgolomb_array()
+    template <typename T>
+    uint64_t array_write(int width, uint64_t count, const T * in, bool little);
+    template <typename T>
+    uint64_t expgolomb_array_write(uint64_t count, const T * in, int n, bool sign);
+
+    // map an Exp-Golomb code number to its signed value (1, -1, 2, -2, ...)
+    static uint64_t expgolomb_signed(uint64_t k)
+    {
+        uint64_t v = (k >> 1) + (k & 1);
+        uint64_t m = (k & 1) - 1;
+        return (v ^ m) - m;
+    }
 public:
     // convert error code to text message
     static char* const err2msg(Error_t code);
 
 public:
-    explicit QBitstream(std::istream * device, bool ownDevice = false);
-    explicit QBitstream(std::ostream * device, bool ownDevice = false);
-    QBitstream(flavor::SmallVector<uint8_t> * device, Bitstream_t mode, bool ownDevice = false);
+    // 'bufsize' is the buffer capacity in bytes; large buffers suit long files, small ones small packets
+    explicit QBitstream(std::istream * device, bool ownDevice = false, int bufsize = BS_BUF_LEN);
+    explicit QBitstream(std::ostream * device, bool ownDevice = false, int bufsize = BS_BUF_LEN);
+    QBitstream(flavor::SmallVector<uint8_t> * device, Bitstream_t mode, bool ownDevice = false, int bufsize = BS_BUF_LEN);
+
+    // POSIX file descriptor input or output (file, pipe or socket), read and written in whole
+    // buffers.  A descriptor opened with O_DIRECT is read and written in aligned blocks.
+    QBitstream(int fd, Bitstream_t mode, bool ownDevice = false, int bufsize = BS_BUF_LEN);
+
+    // file name for the file constructor, as in QBitstream(QBitstream::File{"in.bin"})
+    struct File
+    {
+        const char * name;
+    };
+
+    // memory mapped file input; the data is read in place, without copies into a buffer
+    explicit QBitstream(File file);
+
+    // input read in place from 'size' bytes at 'data'; the memory must stay valid and unchanged
+    // while it is read.  Only the last few bytes are copied, so that reads can run past the end.
+    QBitstream(const uint8_t * data, size_t size);
+
+    // the same, for any contiguous container (std::string, std::string_view, std::vector,
+    // std::array, ...).  A temporary that holds its data would be gone before it is read.
+    template <typename C, typename = decltype(std::data(std::declval<const C &>())),
+              typename std::enable_if<!std::is_array<C>::value, int>::type = 0>
+    explicit QBitstream(const C & c)
+        : QBitstream((const uint8_t *)std::data(c), std::size(c) * sizeof(*std::data(c))) {}
+    template <typename C, typename = decltype(std::data(std::declval<const C &>())),
+              typename std::enable_if<!std::is_reference<C>::value && flavor::owns_data<C>::value, int>::type = 0>
+    explicit QBitstream(C && c) = delete;
 
     // default destructor, does not explicitly close the QIODevice
     ~QBitstream();
@@ -67,6 +257,23 @@ public:
     bool isReadable() {
         return ((int)_type & (int)BS_INPUT) == BS_INPUT;
     }
+
+    // let the buffer double in size, up to 'maxsize' bytes, while refills (or flushes) keep using
+    // all of it; a stream can then start small and still read or write a long file in large blocks
+    void setBufferGrowth(int maxsize);
+
+    // vector output: write straight into the vector storage instead of through a separate
+    // buffer.  The vector grows geometrically and its size is brought up to date as the data is
+    // flushed; it must not be used directly while this is on.  Not with emulation prevention.
+    void setDirectWrite(bool on);
+
+    // output size hint: room for 'n' more bits is reserved in the vector (other devices ignore it)
+    void reserve_bits(uint64_t n);
+
+    // stream or descriptor input: read up to 'blocks' buffers ahead of the parser on a helper thread, so that
+    // refills do not wait for the device (0 turns it off).  The device must not be used
+    // directly while this is on.
+    void setReadAhead(int blocks);
     // bitstream operations
 
     ////////////////
@@ -74,16 +281,65 @@ public:
     ////////////////
 
     // probe next 'n' bits, do not advance
-    uint64_t nextbits(int n);
+    uint64_t nextbits(int n)
+    {
+        // bit offset of cur_bit inside the cached window
+        uint64_t off = cache_off();
+
+        if (off + n > (uint64_t)_cache_len) return refill_cache(n);
+        return n ? (_cache << off) >> (64 - n) : 0;
+    }
 
     // probe next 'n' bits with sign extension, do not advance (sign extension only if n>1)
-    uint64_t snextbits(int n);
+    uint64_t snextbits(int n) { return sext(nextbits(n), n); }
 
     // get next 'n' bits, advance
-    uint64_t getbits(int n);
+    uint64_t getbits(int n)
+    {
+        uint64_t x = nextbits(n);
+        cur_bit += n;
+        tot_bits += n;
+        return x;
+    }
 
     // get next 'n' bits with sign extension, advance (sign extension only if n>1)
-    uint64_t sgetbits(int n);
+    uint64_t sgetbits(int n) { return sext(getbits(n), n); }
+
+    // Compile-time width versions of the above, 0 < N <= 64.  The masks and the sign extension
+    // fold into constant shifts.  With Checked=false the cache check is skipped; this is only
+    // valid while covered by a successful prefetch().
+    template <int N, bool Checked = true>
+    uint64_t nextbits()
+    {
+        static_assert(N > 0 && N <= 64, "bit count must be in 1..64");
+        uint64_t off = cache_off();
+
+        if (Checked && off + N > (uint64_t)_cache_len) return refill_cache(N);
+        return (_cache << off) >> (64 - N);
+    }
+
+    template <int N, bool Checked = true>
+    uint64_t snextbits() { return sext<N>(nextbits<N, Checked>()); }
+
+    template <int N, bool Checked = true>
+    uint64_t getbits()
+    {
+        uint64_t x = nextbits<N, Checked>();
+        cur_bit += N;
+        tot_bits += N;
+        return x;
+    }
+
+    template <int N, bool Checked = true>
+    uint64_t sgetbits() { return sext<N>(getbits<N, Checked>()); }
+
+    // make sure the next 'n' bits (n <= 57) are in the read cache, so that unchecked reads of
+    // up to 'n' bits in total may follow; false if the data ends before that
+    bool prefetch(int n)
+    {
+        if (cache_off() + n > (uint64_t)_cache_len) refill_cache(n);
+        return cache_off() + n <= (uint64_t)_cache_len;
+    }
 
     // float
     float nextfloat(void);
@@ -97,8 +353,30 @@ public:
     long double nextldouble(void) { return nextdouble(); }
     long double getldouble(void) { return getdouble(); }
 
-    // put 'n' bits
-    int putbits(uint64_t value, int n);
+    // put 'n' bits (0..64).  Bits collect in a 64-bit register, which goes into the buffer as
+    // one big endian word whenever it fills up.
+    int putbits(uint64_t value, int n)
+    {
+        uint64_t val = n < 64 ? value & ~(~0ULL << n) : value;
+        int r = 64 - _wbits;        // bits that complete the register
+
+        if (n < r)
+        {
+            _wacc = (_wacc << n) | val;
+            _wbits += n;
+        }
+        else
+        {
+            int at = (cur_bit - _wbits) >> 3;
+            if (at + 8 > buf_len) return putbits_slow(value, n);
+            flavor::store_be64(buf + at, r == 64 ? val : (_wacc << r) | (val >> (n - r)));
+            _wacc = val;
+            _wbits = n - r;
+        }
+        cur_bit += n;
+        tot_bits += n;
+        return value;
+    }
 
     // float
     float putfloat(float value);
@@ -123,6 +401,21 @@ public:
     // jltd - true if underlying io is eof and there are no available bits in the buffer
     bool eof();
 
+    // H.264/HEVC/VVC NAL units.  On input, remove the emulation prevention bytes (00 00 03 -> 00 00)
+    // as the data is buffered, so the payload reads as RBSP without an unescaped copy; bytes
+    // already buffered are converted when enabled.  On output, insert them (00 00 0x -> 00 00 03 0x,
+    // x <= 3) as the buffer is flushed, so RBSP written with putbits() goes out escaped.  The
+    // bitstream can not seek while enabled.
+    void setEmulationPrevention(bool on);
+    bool emulationPrevention() const { return _ep; }
+
+    // input byte offset of the RBSP bit position 'pos' (as returned by getpos()), for positions
+    // up to the current one
+    uint64_t rawpos(uint64_t pos);
+
+    // number of emulation prevention bytes removed (input) or inserted (output) so far
+    uint64_t epbytes() const { return _ep_count; }
+
     ///////////////////
     // Little endian //
     ///////////////////
@@ -158,6 +451,39 @@ public:
     // get current position in bits (both input/output)
     uint64_t getpos(void) { return (canSeek() ? tell() : tot_bits); }
 
+    // reader state saved by mark()
+    struct Mark
+    {
+        int64_t pos;        // position as tell(), -1 if the input can not seek
+        uint64_t bits;      // total bits read
+        Error_t err;
+    };
+
+    // Speculative parsing (input): mark() saves the position and keeps the buffer from there on
+    // until unmark(), so that rewind() to it only moves the cursor; the read cache stays valid
+    // too.  Without a retained buffer, rewind() seeks; it returns false if the input can not.
+    // The buffer lets go of a mark that would keep more than half of its largest size.
+    Mark mark();
+    bool rewind(const Mark & m);
+    void unmark(const Mark & m);
+
+    // writer state saved by checkpoint()
+    struct Checkpoint
+    {
+        uint64_t bits;      // total bits written
+        uint64_t acc;       // the bit register
+        int wbits;
+        uint64_t size;      // vector size, for direct writes
+        Error_t err;
+    };
+
+    // Trial encoding (output): the output from checkpoint() on is held in the buffer (which
+    // grows for it) until commit(), so rollback() discards it without a copy.  flushbits() and
+    // seek() commit everything; rollback() returns false once the output went out.
+    Checkpoint checkpoint();
+    bool rollback(const Checkpoint & cp);
+    void commit(const Checkpoint & cp);
+
 
     // flush buffer; left-over bits are also output with zero padding (output only)
     void flushbits();
@@ -175,12 +501,106 @@ public:
     // Exp Golomb    //
     ///////////////////
 
-    uint64_t nextbits_expgolomb(int32_t n);
-    uint64_t snextbits_expgolomb(int32_t n);
-    uint64_t getbits_expgolomb(int32_t n);
-    uint64_t sgetbits_expgolomb(int32_t n);
-    int putbits_expgolomb(uint64_t value, int32_t n);
-    int putbits_sexpgolomb(uint64_t value, int32_t n);
+    // probe an unsigned Exp-Golomb code with at most 'n' leading zeros
+    uint64_t nextbits_expgolomb(int32_t n)
+    {
+        uint64_t off = cache_off();
+
+        // the common case: at least 57 bits cached, which holds any code with up to 28 zeros
+        if (off + 57 <= (uint64_t)_cache_len)
+        {
+            uint64_t w = _cache << off;
+            int z = flavor::clz64(w | 1);
+            int len = 2 * z + 1;
+
+            if (len <= 57 && z <= n)
+            {
+                _eglen = len;
+                return (w >> (64 - len)) - 1;
+            }
+        }
+        return expgolomb_slow(n);
+    }
+
+    uint64_t snextbits_expgolomb(int32_t n) { return expgolomb_signed(nextbits_expgolomb(n)); }
+
+    uint64_t getbits_expgolomb(int32_t n)
+    {
+        uint64_t x = nextbits_expgolomb(n);
+        cur_bit += _eglen;
+        tot_bits += _eglen;
+        return x;
+    }
+
+    uint64_t sgetbits_expgolomb(int32_t n) { return expgolomb_signed(getbits_expgolomb(n)); }
+
+    // put the unsigned Exp-Golomb code of the low 'n' bits of 'value'; codes of up to 63 bits
+    // (values below 2^32 - 1) go out in one putbits()
+    int putbits_expgolomb(uint64_t value, int32_t n)
+    {
+        uint64_t val = n < 64 ? value & ~(~0ULL << n) : value;
+        uint64_t k = val + 1;
+
+        // 64 leading zeros do not fit our implementation
+        if (!k)
+        {
+            seterror(E_WRITE_FAILED);
+            return val;
+        }
+
+        int len = 64 - flavor::clz64(k);
+        if (len <= 32) putbits(k, 2 * len - 1);
+        else
+        {
+            putbits(0, len - 1);
+            putbits(k, len);
+        }
+        return val;
+    }
+
+    // signed values map to code numbers 1, -1, 2, -2, ... -> 1, 2, 3, 4, ...
+    int putbits_sexpgolomb(uint64_t value, int32_t n)
+    {
+        int64_t v = (int64_t)value;
+        putbits_expgolomb(v > 0 ? 2 * (uint64_t)v - 1 : 0 - 2 * (uint64_t)v, n);
+        return value;
+    }
+
+    ///////////////////
+    // Arrays        //
+    ///////////////////
+
+    // get 'count' values of 'width' bits (1..64) into 'out'; returns the number of values read.
+    // Defined for 8, 16, 32 and 64 bit signed and unsigned element types.
+    template <typename T>
+    uint64_t getbits_array(int width, uint64_t count, T * out) { return array_read(width, count, out, false, false); }
+    template <typename T>
+    uint64_t sgetbits_array(int width, uint64_t count, T * out) { return array_read(width, count, out, false, true); }
+    template <typename T>
+    uint64_t little_getbits_array(int width, uint64_t count, T * out) { return array_read(width, count, out, true, false); }
+    template <typename T>
+    uint64_t little_sgetbits_array(int width, uint64_t count, T * out) { return array_read(width, count, out, true, true); }
+
+    // get 'count' Exp-Golomb codes (at most 'n' leading zeros each) into 'out'; returns the number
+    // of values read, which is short of 'count' at an invalid code or at the end of the data.
+    template <typename T>
+    uint64_t getbits_expgolomb_array(uint64_t count, T * out, int32_t n = 63) { return expgolomb_array_read(count, out, n, false); }
+    template <typename T>
+    uint64_t sgetbits_expgolomb_array(uint64_t count, T * out, int32_t n = 63) { return expgolomb_array_read(count, out, n, true); }
+
+    // put 'count' values of 'width' bits (1..64) from 'in'; returns the number of values written.
+    // Defined for the same element types as getbits_array().
+    template <typename T>
+    uint64_t putbits_array(int width, uint64_t count, const T * in) { return array_write(width, count, in, false); }
+    template <typename T>
+    uint64_t little_putbits_array(int width, uint64_t count, const T * in) { return array_write(width, count, in, true); }
+
+    // put the Exp-Golomb codes of 'count' values from 'in' (see putbits_expgolomb()); returns
+    // the number of values written, short of 'count' at a value that has no code.
+    template <typename T>
+    uint64_t putbits_expgolomb_array(uint64_t count, const T * in, int32_t n = 64) { return expgolomb_array_write(count, in, n, false); }
+    template <typename T>
+    uint64_t putbits_sexpgolomb_array(uint64_t count, const T * in, int32_t n = 64) { return expgolomb_array_write(count, in, n, true); }
 };
 
 #endif // QBITSTREAM_H
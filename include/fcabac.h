@@ -0,0 +1,124 @@
+#ifndef FCABAC_H
+#define FCABAC_H
+
+#include <stdint.h>
+#include "fbitstream.h"
+
+namespace flavor {
+
+// Binary arithmetic (CABAC style) decoding engine, as specified in H.264/HEVC.
+//
+// Context models are single bytes holding (pStateIdx << 1) | valMPS; callers keep them in
+// plain arrays.  The 9-bit codIOffset register is held together with up to 32+7 bits read
+// ahead from the QBitstream, so renormalization is a shift by the whole amount needed and the
+// bitstream is only touched once per 32 bits.
+class CabacDecoder
+{
+public:
+    CabacDecoder() : _bs(NULL), _range(0), _value(0), _bits(0) {}
+    explicit CabacDecoder(QBitstream * bs) { init(bs); }
+
+    // start decoding at the current position of bs (reads codIOffset)
+    void init(QBitstream * bs);
+
+    // initialize a context model from its (m, n) pair and the slice QP
+    static void init_context(uint8_t & ctx, int m, int n, int qp);
+
+    // initialize 'count' context models from consecutive (m, n) pairs
+    static void init_contexts(uint8_t * ctx, const int8_t (*mn)[2], int count, int qp);
+
+    // decode a bin with the context model ctx (which is updated)
+    int decode_decision(uint8_t & ctx)
+    {
+        int s = ctx >> 1;
+        uint32_t lps = lps_range[s][(_range >> 6) & 3];
+        int bin;
+
+        if (_bits < 8) refill();
+
+        _range -= lps;
+        if (_value < ((uint64_t)_range << _bits))
+        {
+            bin = ctx & 1;
+            ctx = next_mps[ctx];
+        }
+        else
+        {
+            _value -= (uint64_t)_range << _bits;
+            _range = lps;
+            bin = !(ctx & 1);
+            ctx = next_lps[ctx];
+        }
+
+        // renormalize to 9 bits in one step
+        int n = flavor::clz64(_range) - 55;
+        _range <<= n;
+        _bits -= n;
+        return bin;
+    }
+
+    // decode an equiprobable bin
+    int decode_bypass()
+    {
+        if (!_bits) refill();
+
+        _bits--;
+        uint64_t r = (uint64_t)_range << _bits;
+        if (_value >= r)
+        {
+            _value -= r;
+            return 1;
+        }
+        return 0;
+    }
+
+    // decode n (0..16) bypass bins at once; the first bin is the most significant bit
+    uint32_t decode_bypass_bits(int n)
+    {
+        if (_bits < n) refill();
+
+        // the bins are the n-bit quotient of the extended offset by the range
+        _bits -= n;
+        uint64_t q = (_value >> _bits) / _range;
+        _value -= (q * _range) << _bits;
+        return (uint32_t)q;
+    }
+
+    // decode a terminating bin; after a 1 the arithmetic decoding is finished
+    int decode_terminate()
+    {
+        if (_bits < 8) refill();
+
+        _range -= 2;
+        if (_value >= ((uint64_t)_range << _bits)) return 1;
+
+        int n = flavor::clz64(_range) - 55;
+        _range <<= n;
+        _bits -= n;
+        return 0;
+    }
+
+    // bit position of the decoder's read pointer in the bitstream, i.e. just past the last
+    // bit taken into codIOffset (the bits read ahead are not counted)
+    uint64_t getpos() const { return _bs->getpos() - _bits; }
+
+    static const uint8_t lps_range[64][4];  // rangeTabLPS
+    static const uint8_t next_mps[128];     // context transition after an MPS
+    static const uint8_t next_lps[128];     // context transition after an LPS
+
+private:
+    void refill()
+    {
+        _value = (_value << 32) | _bs->getbits(32);
+        _bits += 32;
+    }
+
+    QBitstream * _bs;
+    uint32_t _range;        // codIRange
+    uint64_t _value;        // codIOffset followed by _bits bits read ahead
+    int _bits;              // number of bits read ahead
+};
+
+} // namespace flavor
+
+#endif // FCABAC_H
@@ -4,7 +4,11 @@
 #include "stdint.h"
 #include "flavori.h"
 #include "fbitstream.h"
+#include "fbitcount.h"
 #include "smallvector.h"
+#include "fvlc.h"
+#include "fcabac.h"
+#include "freadahead.h"
 
 // bitstream error reporting function
 // extern void flerror(const char* fmt, ...);
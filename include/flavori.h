@@ -54,6 +54,8 @@ typedef enum {
  *
  * This is the interface of the bitstream I/O class that flavorc expects.
  * All methods are declared pure virtual, and *must* be defined in a derived class.
+ * Code that does not need runtime polymorphism can be compiled against a concrete,
+ * final implementation (e.g. QBitstream) so the calls are resolved and inlined statically.
  *
  */
 
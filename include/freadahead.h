@@ -0,0 +1,79 @@
+#ifndef FREADAHEAD_H
+#define FREADAHEAD_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <smallvector.h>
+
+namespace flavor {
+
+// Reads a source ahead of its consumer on a helper thread.
+//
+// The thread keeps a ring of blocks filled; a block is handed over to the consumer (and back)
+// through two atomic counters, so the steady state takes no locks.  The mutex is only used to
+// sleep when the ring is empty (consumer) or full (thread).  A block shorter than the block
+// size marks the end of the source.
+class ReadAhead
+{
+public:
+    // reads up to 'n' bytes into 'p'; returns the bytes read, short only at the end of the
+    // source, or -1 on an error
+    typedef std::function<int64_t(uint8_t * p, int n)> Source;
+
+    // 'blocks' blocks of 'size' bytes; reading starts at once, at source offset 'pos'
+    ReadAhead(Source source, int blocks, int size, int64_t pos);
+    ~ReadAhead();
+
+    // copy the next 'n' bytes into 'p', waiting for them if needed; returns the bytes copied,
+    // short only at the end of the source, or -1 on an error
+    int64_t read(uint8_t * p, int64_t n);
+
+    // source offset of the next byte read() returns
+    int64_t pos() const { return _pos; }
+
+    // true if read() has no more bytes to return (or fails); waits for the thread to find out
+    bool atend();
+
+    // stop the thread, drop what was read ahead, and restart at source offset 'pos' (after the
+    // consumer moved the source there)
+    void restart(int64_t pos);
+
+    // stop the thread; the source is then at an unspecified offset past pos()
+    void stop();
+
+private:
+    struct Block
+    {
+        SmallVector<uint8_t> data;
+        int64_t len;        // bytes in data, -1 on a read error
+    };
+
+    void run();             // the helper thread
+    Block & current();      // the block being read, once filled
+    void start();
+
+    Source _source;
+    SmallVector<Block> _ring;
+    int _size;              // block size
+
+    std::atomic<uint64_t> _filled;      // blocks filled by the thread so far
+    std::atomic<uint64_t> _taken;       // blocks given back by the consumer so far
+    std::atomic<bool> _stop;
+    std::atomic<bool> _cwait;           // the consumer is waiting for a block
+    std::atomic<bool> _pwait;           // the thread is waiting for a free block
+    std::mutex _lock;
+    std::condition_variable _wake;
+    std::thread _thread;
+
+    int64_t _off;           // consumer offset in the current block
+    int64_t _pos;           // source offset of the consumer
+    bool _done;             // the consumer reached the end of the source
+};
+
+} // namespace flavor
+
+#endif // FREADAHEAD_H
@@ -0,0 +1,92 @@
+#ifndef FVLC_H
+#define FVLC_H
+
+#include <stdint.h>
+#include <smallvector.h>
+
+namespace flavor {
+
+// Multi-level lookup table for variable length codes (VLC/Huffman).
+//
+// The first level is indexed by the next 'bits' bits of the stream.  Codes longer than that
+// continue in sub-tables indexed by the following bits, so a symbol is decoded with a single
+// peek of the longest code length and a single skip of the actual code length.  The tables
+// and the scratch space are kept between builds, so rebuilding (e.g. for adaptive per-frame
+// tables) does not allocate once the largest table has been seen.
+class VLCTable
+{
+public:
+    // table entry: len > 0 is a symbol whose code ends 'len' bits into this level,
+    // len < 0 is a sub-table of -len index bits at offset 'sym', len == 0 is an invalid code
+    struct Entry {
+        int32_t sym;
+        int32_t len;
+    };
+
+    VLCTable() : _bits(0), _maxlen(0) {}
+
+    // build from n code/length pairs (codes right adjusted, lengths 1..32, 0 = unused);
+    // syms gives the decoded symbols, or the code index if NULL.  Returns false if the codes
+    // are not prefix free or a length is over 32 (the table is then empty, and decode()
+    // returns -1).
+    bool build(int n, const uint32_t * codes, const uint8_t * lens, const int32_t * syms = NULL, int bits = 9);
+
+    // build canonical codes from code lengths alone (shorter codes first, and in symbol order
+    // within a length), as used by JPEG and deflate style Huffman tables
+    bool build_canonical(int n, const uint8_t * lens, const int32_t * syms = NULL, int bits = 9);
+
+    // decode one symbol; returns -1 (and does not advance) on an invalid code
+    template <class Bitstream>
+    int32_t decode(Bitstream & bs) const
+    {
+        // an empty (or failed) table
+        if (!_maxlen) return -1;
+
+        // the longest code, left adjusted
+        uint64_t peek = bs.nextbits(_maxlen) << (64 - _maxlen);
+        const Entry * e = &_table[peek >> (64 - _bits)];
+        int used = 0;
+        int nb = _bits;
+
+        while (e->len < 0)
+        {
+            used += nb;
+            nb = -e->len;
+            e = &_table[e->sym + ((peek << used) >> (64 - nb))];
+        }
+        if (!e->len) return -1;
+
+        bs.skipbits(used + e->len);
+        return e->sym;
+    }
+
+    // longest code length, in bits
+    int maxlen() const { return _maxlen; }
+
+    // the table entries (first level at offset 0)
+    const SmallVector<Entry> & table() const { return _table; }
+
+private:
+    struct Code {
+        uint32_t code;      // left adjusted
+        int32_t len;
+        int32_t sym;
+    };
+
+    // fill the table for codes c[0..n) that share their first 'consumed' bits; returns its offset or -1
+    int build_level(const Code * c, int n, int nbits, int consumed);
+
+    bool build_sorted(int bits);
+
+    // empty the table, so that decode() returns -1
+    void clear();
+
+    SmallVector<Entry> _table;
+    SmallVector<Code> _codes;   // scratch space for building
+    int _bits;                  // index bits of the first level
+    int _maxlen;                // longest code length
+};
+
+} // namespace flavor
+
+#endif // FVLC_H
@@ -5,8 +5,33 @@
 #include <fcntl.h>
 #include <algorithm>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <fstream>
+#include <errno.h>
+
+#if defined(_MSC_VER)
+#include <malloc.h>
+#endif
+#if defined(_WIN32)
+#include <io.h>
+#endif
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #include "fbitstream.h"
+#include "fbitops.h"
+#include "freadahead.h"
 
 // This is our standard implementation in case it is not overriden by the user
 void flerror(const char* fmt, ...)
@@ -24,16 +49,11 @@ void flerror(const char* fmt, ...)
 
 #define BSHIFT      3
 
-static const uint8_t charbitmask[8] = {
-    0x80,
-    0x40,
-    0x20,
-    0x10,
-    0x08,
-    0x04,
-    0x02,
-    0x01
-};
+// buffer window over memory input, in bytes; small enough that bit positions in it fit an int
+static const int BS_MAP_WINDOW = 1 << 27;
+
+// memory input of no bytes
+static uint8_t nodata[1];
 
 // masks for bitstring manipulation
 static const uint64_t mask[65] = {
@@ -101,85 +121,314 @@ static const uint64_t smask[65] = {
     0x8000000000000000
 };
 
-QBitstream::QBitstream(std::istream * device, bool ownDevice)
+// find the first byte equal to 'c' in [p, e); returns e if there is none
+static const uint8_t * scanbyte(const uint8_t * p, const uint8_t * e, uint8_t c)
 {
-    // get the mode the device was openend in
-    _input_device = device;
+#if defined(__AVX2__)
+    const __m256i k32 = _mm256_set1_epi8((char)c);
+    for (; e - p >= 32; p += 32)
+    {
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), k32));
+        if (m) return p + flavor::ctz32(m);
+    }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i k16 = _mm_set1_epi8((char)c);
+    for (; e - p >= 16; p += 16)
+    {
+        uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), k16));
+        if (m) return p + flavor::ctz32(m);
+    }
+#endif
+    if (p >= e) return e;
+    const uint8_t * r = (const uint8_t *)memchr(p, c, e - p);
+    return r ? r : e;
+}
+
+// find the first pair of zero bytes in [p, e); returns e if there is none
+static const uint8_t * scanzeros(const uint8_t * p, const uint8_t * e)
+{
+#if defined(__AVX2__)
+    const __m256i z32 = _mm256_setzero_si256();
+    for (; e - p >= 33; p += 32)
+    {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), z32);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 1)), z32);
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(a, b));
+        if (m) return p + flavor::ctz32(m);
+    }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i z16 = _mm_setzero_si128();
+    for (; e - p >= 17; p += 16)
+    {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), z16);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 1)), z16);
+        uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_and_si128(a, b));
+        if (m) return p + flavor::ctz32(m);
+    }
+#endif
+    for (;; p++)
+    {
+        p = scanbyte(p, e, 0);
+        if (e - p < 2) return e;
+        if (!p[1]) return p;
+    }
+}
+
+// buffers are cache line aligned, and page aligned once they span pages
+static unsigned char * buf_alloc(int size)
+{
+    size_t align = size >= 4096 ? 4096 : 64;
+#if defined(_MSC_VER)
+    return (unsigned char *)_aligned_malloc(size, align);
+#else
+    void * p = NULL;
+    if (posix_memalign(&p, align, size)) throw std::bad_alloc();
+    return (unsigned char *)p;
+#endif
+}
+
+static void buf_free(unsigned char * p)
+{
+#if defined(_MSC_VER)
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+// descriptor position, or -1 if it can not seek (pipes, sockets)
+static int64_t sys_seek(int fd, int64_t off, int whence)
+{
+#if defined(_WIN32)
+    return _lseeki64(fd, off, whence);
+#else
+    return lseek(fd, off, whence);
+#endif
+}
+
+// one read at 'off' (or at the descriptor position if off < 0), retried when interrupted
+static int64_t sys_read(int fd, uint8_t * p, int64_t n, int64_t off)
+{
+#if defined(_WIN32)
+    if (off >= 0 && _lseeki64(fd, off, SEEK_SET) < 0) return -1;
+    return _read(fd, p, (unsigned int)n);
+#else
+    for (;;)
+    {
+        ssize_t r = off >= 0 ? pread(fd, p, (size_t)n, off) : read(fd, p, (size_t)n);
+        if (r >= 0 || errno != EINTR) return r;
+    }
+#endif
+}
+
+// write all 'n' bytes; false on an error
+static bool sys_write(int fd, const uint8_t * p, int64_t n)
+{
+    while (n > 0)
+    {
+#if defined(_WIN32)
+        int64_t r = _write(fd, p, (unsigned int)n);
+#else
+        int64_t r = write(fd, p, (size_t)n);
+        if (r < 0 && errno == EINTR) continue;
+#endif
+        if (r <= 0) return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+// every member in its idle state: no device, no buffer, no error
+void QBitstream::init(Bitstream_t type, bool ownDevice)
+{
+    _type = type;
+    _input_device = NULL;
+    _output_device = NULL;
+    _spos = 0;
+    _sseek = false;
+    _vector = NULL;
+    _vpos = 0;
+    _vdirect = false;
+    _map = NULL;
+    _map_size = 0;
+    _map_len = 0;
+    _map_pos = 0;
+    _ra = NULL;
+    _fd = -1;
+    _fd_seek = false;
+    _fd_direct = false;
+    _fd_pos = 0;
+    _dbuf = NULL;
+    _dbuf_size = 0;
+    _dbuf_off = 0;
+    _dbuf_len = 0;
     _ownDevice = ownDevice;
-    _type = BS_INPUT;
 
     cur_bit = 0;
     tot_bits = 0;
-    buf_len = BS_BUF_LEN;
-    buf = new unsigned char[buf_len];
-    memset(buf, 0, BS_BUF_LEN);
+    _buf_size = BS_BUF_LEN;
+    _buf_max = 0;
+    _buf_fills = 0;
+    buf = NULL;
+    buf_len = 0;
+    _cache = 0;
+    _cache_len = 0;
+    invalidate_cache();
+    _eglen = 0;
+    _mark_bits = 0;
+    _wacc = 0;
+    _wbits = 0;
+    _ep = false;
+    _ep_zeros = 0;
+    _ep_count = 0;
+    _ep_rbsp = 0;
+    _ep_origin = 0;
     end = 0;
     err_code = E_NONE;
+}
+
+QBitstream::QBitstream(std::istream * device, bool ownDevice, int bufsize)
+{
+    init(BS_INPUT, ownDevice);
+    _input_device = device;
+
+    // a stream that can not tell where it is (a pipe) can not seek either
+    int64_t spos = device->tellg();
+    _spos = std::max(spos, (int64_t)0);
+    _sseek = spos >= 0;
+
+    resize_buf(bufsize, 0);
+    buf_len = _buf_size;
 
     // read some
-    cur_bit = BS_BUF_LEN << BSHIFT;  // fake that we are at the end of buffer
+    cur_bit = buf_len << BSHIFT;  // fake that we are at the end of buffer
     fill_buf();
 }
 
-QBitstream::QBitstream(std::ostream * device, bool ownDevice)
+QBitstream::QBitstream(std::ostream * device, bool ownDevice, int bufsize)
 {
-    // get the mode the device was openend in
+    init(BS_OUTPUT, ownDevice);
     _output_device = device;
-    _ownDevice = ownDevice;
-    _type = BS_OUTPUT;
+    _spos = std::max((int64_t)device->tellp(), (int64_t)0);
 
-    cur_bit = 0;
-    tot_bits = 0;
-    buf_len = BS_BUF_LEN;
-    buf = new unsigned char[buf_len];
-    memset(buf, 0, BS_BUF_LEN);
-    end = 0;
-    err_code = E_NONE;
+    resize_buf(bufsize, 0);
+    buf_len = _buf_size;
 }
 
-QBitstream::QBitstream(flavor::SmallVector<uint8_t> * device, Bitstream_t mode, bool ownDevice)
+QBitstream::QBitstream(flavor::SmallVector<uint8_t> * device, Bitstream_t mode, bool ownDevice, int bufsize)
 {
-    _output_device = NULL;
-    _input_device = NULL;
+    init(mode == BS_OUTPUT ? BS_OUTPUT : BS_INPUT, ownDevice);
     _vector = device;
-    _vpos = 0;
-    
+
     if(mode == BS_OUTPUT)
     {
-         // get the mode the device was openend in
-        _ownDevice = ownDevice;
-        _type = BS_OUTPUT;
-
-        cur_bit = 0;
-        tot_bits = 0;
-        buf_len = BS_BUF_LEN;
-        buf = new unsigned char[buf_len];
-        memset(buf, 0, BS_BUF_LEN);
-        end = 0;
-        err_code = E_NONE;
+        resize_buf(bufsize, 0);
+        buf_len = _buf_size;
     }
     else
     {
-        // get the mode the device was openend in
-        _input_device = NULL;
-        _output_device = NULL;
-        _ownDevice = ownDevice;
-        _type = BS_INPUT;
+        // the vector is read in place, like any other memory
+        _map = device->size() ? device->data() : nodata;
+        _map_size = device->size();
+        buf = _map;
 
-        cur_bit = 0;
-        tot_bits = 0;
-        buf_len = BS_BUF_LEN;
-        buf = new unsigned char[buf_len];
-        memset(buf, 0, BS_BUF_LEN);
-        end = 0;
-        err_code = E_NONE;
+        // read some
+        fill_map(0);
+    }
+}
+
+QBitstream::QBitstream(int fd, Bitstream_t mode, bool ownDevice, int bufsize)
+{
+    init(mode == BS_OUTPUT ? BS_OUTPUT : BS_INPUT, ownDevice);
+    _fd = fd;
+
+    // pipes and sockets can not seek, and are read sequentially
+    int64_t pos = sys_seek(fd, 0, SEEK_CUR);
+    _fd_seek = pos >= 0;
+    _fd_pos = pos >= 0 ? pos : 0;
+#if defined(O_DIRECT)
+    int flags = fcntl(fd, F_GETFL);
+    _fd_direct = flags >= 0 && (flags & O_DIRECT);
+#endif
+    if (_fd_direct)
+    {
+        _dbuf_size = (std::max(bufsize, BS_DIRECT_ALIGN) + BS_DIRECT_ALIGN - 1) & ~(BS_DIRECT_ALIGN - 1);
+        _dbuf = buf_alloc(_dbuf_size);
+    }
+
+    resize_buf(bufsize, 0);
+    buf_len = _buf_size;
 
+    if (fd < 0) seterror(_type == BS_INPUT ? E_READ_FAILED : E_WRITE_FAILED);
+
+    if (_type == BS_INPUT)
+    {
         // read some
-        cur_bit = BS_BUF_LEN << BSHIFT;  // fake that we are at the end of buffer
+        cur_bit = buf_len << BSHIFT;  // fake that we are at the end of buffer
         fill_buf();
     }
 }
 
+QBitstream::QBitstream(const uint8_t * data, size_t size)
+{
+    init(BS_INPUT, false);
+    _map = size ? (uint8_t *)data : nodata;
+    _map_size = size;
+    buf = _map;
+
+    // read some
+    fill_map(0);
+}
+
+QBitstream::QBitstream(File file)
+{
+    init(BS_INPUT, false);
+
+#if !defined(_WIN32)
+    int fd = open(file.name, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0) _map_size = st.st_size;
+    else seterror(E_READ_FAILED);
+
+    // reserve the file size and a page of zeros, and map the file over the front of it, so loads
+    // past the end of the data read zeros instead of faulting
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    _map_len = (_map_size + page - 1) / page * page + page;
+    void * m = mmap(NULL, _map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m != MAP_FAILED && _map_size &&
+        mmap(m, _map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        seterror(E_READ_FAILED);
+        _map_size = 0;
+    }
+    if (fd >= 0) close(fd);
+
+    if (m != MAP_FAILED)
+    {
+        _map = (uint8_t *)m;
+        madvise(_map, _map_len, MADV_SEQUENTIAL);
+        buf = _map;
+        fill_map(0);
+        return;
+    }
+    seterror(E_READ_FAILED);
+#else
+    // no mapping here, read the file through a stream
+    _input_device = new std::ifstream(file.name, std::ios::binary);
+    _ownDevice = true;
+#endif
+
+    resize_buf(BS_BUF_LEN, 0);
+    buf_len = _buf_size;
+
+    // read some
+    cur_bit = buf_len << BSHIFT;  // fake that we are at the end of buffer
+    fill_buf();
+}
+
 // standard destructor
 QBitstream::~QBitstream()
 {
@@ -191,10 +440,27 @@ QBitstream::~QBitstream()
         {
             flushbits();
         }
-        delete[] buf;
+        if (!_map && !_vdirect) buf_free(buf);
         buf = (unsigned char*)0;
     }
 
+#if !defined(_WIN32)
+    if (_map_len)
+    {
+        munmap(_map, _map_len);
+    }
+#endif
+
+    // the helper thread may still be reading the device
+    delete _ra;
+
+    if (_fd >= 0)
+    {
+        if (_type == BS_OUTPUT) fd_finish();
+        if (_ownDevice) close(_fd);
+    }
+    buf_free(_dbuf);
+
     if(_ownDevice)
     {
         if(_input_device)
@@ -232,12 +498,10 @@ char* const QBitstream::err2msg(Error_t code)
 // Big endian //
 ////////////////
 
-// returns 'n' bits as unsigned int; does not advance bit pointer
-uint64_t QBitstream::nextbits(int n)
+// reload the cache from the byte holding cur_bit; slow path of nextbits
+uint64_t QBitstream::refill_cache(int n)
 {
-    uint64_t x;                 // the value we will return
     unsigned char *v;           // the byte where cur_bit points to
-    int s;             // number of bits to shift
 
     // make sure we have enough data
     if (cur_bit + n > (buf_len << BSHIFT))
@@ -245,208 +509,70 @@ uint64_t QBitstream::nextbits(int n)
         fill_buf();
     }
 
-    // starting byte in buffer
-    v = buf + (cur_bit >> BSHIFT);
-
-    // load 8 bytes, a byte at a time - this way endianess is automatically taken care of
-    x = ((uint64_t)v[0] << 56) |
-            ((uint64_t)v[1] << 48) |
-            ((uint64_t)v[2] << 40) |
-            ((uint64_t)v[3] << 32) |
-            ((uint64_t)v[4] << 24) |
-            ((uint64_t)v[5] << 16) |
-            ((uint64_t)v[6] << 8) |
-            (uint64_t)v[7];
-
-    // figure out how much shifting is required
-    s = 64 - ((cur_bit % 8) + n);
-
-    if (s >= 0)
-    {
-        // need right adjust
-        x = (x >> s);
-    }
-    else
-    {
-        // shift left and read an extra byte
-        x = x << -s;
-        x |= v[8] >> (8 + s);
-    }
-    return (x & mask[n]);
-}
-
-int QBitstream::_countZero(int maxz)
-{
-    // make sure we have enough data
-    if ((err_code != E_END_OF_DATA) && cur_bit + maxz > (buf_len << BSHIFT))
+    if (cur_bit >= (buf_len << BSHIFT))
     {
-        fill_buf();
+        // past the end of the data
+        invalidate_cache();
+        return 0;
     }
 
-    if((buf_len << BSHIFT) - cur_bit < maxz) maxz = (buf_len << BSHIFT) - cur_bit;
+    // starting byte in buffer; the buffer is padded, so the load never overruns
+    v = buf + (cur_bit >> BSHIFT);
+    _cache = flavor::load_be64(v);
+    _cache_pos = cur_bit & ~7;
+    _cache_len = std::max(0, std::min(64, (buf_len << BSHIFT) - _cache_pos));
 
-    // count up to maxz zeros without advancing.
-    // if maxz is reached, _zcount will be -1 indicating error
-    _zcount = -1;
-    for(int i = 0; i < maxz; i++)
+    if (!n)
     {
-        int byteindex = (i + cur_bit) >> BSHIFT;
-        int bitindex = (i + cur_bit) % 8;
-        unsigned char vv = buf[byteindex];
-        if(vv & charbitmask[bitindex])
-        {
-            // this is a one
-            _zcount = i;
-            break;
-        }
+        return 0;
     }
-    return _zcount;
+
+    return peekbits_at(cur_bit, n);
 }
 
-// Read unsigned Exp-Golomb code from bitstream
-uint64_t QBitstream::nextbits_expgolomb(int n)
+// count up to maxz zeros from the current bit position without advancing; -1 if there is
+// no '1' within maxz bits.  The caller makes sure the bits are buffered.
+int QBitstream::_countZero(int maxz)
 {
-    int zcount = _countZero(n + 1);
+    int avail = (buf_len << BSHIFT) - cur_bit;
+    if (avail < maxz) maxz = avail;
 
-    // make sure we have zcount * 2 + 1 bits available
-    // if after a fillbuf, and we are at E_END_OF_DATA, this is a failure
-    if ((err_code != E_END_OF_DATA) && cur_bit + (zcount * 2 + 1) > (buf_len << BSHIFT))
+    // every load holds at least 57 valid bits
+    for (int z = 0; z < maxz; z += 57)
     {
-        fill_buf();
-        if(err_code == E_END_OF_DATA)
+        int pos = cur_bit + z;
+        uint64_t w = flavor::load_be64(buf + (pos >> BSHIFT)) << (pos & 7);
+        if (w)
         {
-            if (cur_bit + (zcount * 2 + 1) > (buf_len << BSHIFT))
-            {
-                // we won't have enough data
-                return 0;
-            }
+            z += flavor::clz64(w);
+            return z < maxz ? z : -1;
         }
     }
-
-    // from this point, this is essentially the same as nextbits
-    uint64_t x;                 // the value we will return
-    unsigned char *v;           // the byte where cur_bit points to
-    int s;                      // number of bits to shift
-
-    // starting byte in buffer
-    int abit = cur_bit + zcount;
-    v = buf + (abit >> BSHIFT);
-
-    // load 8 bytes, a byte at a time - this way endianess is automatically taken care of
-    x = ((uint64_t)v[0] << 56) |
-            ((uint64_t)v[1] << 48) |
-            ((uint64_t)v[2] << 40) |
-            ((uint64_t)v[3] << 32) |
-            ((uint64_t)v[4] << 24) |
-            ((uint64_t)v[5] << 16) |
-            ((uint64_t)v[6] << 8) |
-            (uint64_t)v[7];
-
-    // figure out how much shifting is required
-    s = 64 - ((abit % 8) + zcount + 1);
-
-    if (s >= 0)
-    {
-        x = (x >> s);   // need right adjust
-    }
-    else
-    {                      // shift left and read an extra byte
-        x = x << -s;
-        x |= v[8] >> (8+s);
-    }
-    return (x & mask[zcount + 1]) - 1;
-}
-
-// Read signed Exp-Golomb code from bitstream
-uint64_t QBitstream::snextbits_expgolomb(int n)
-{
-    uint64_t res = nextbits_expgolomb(n);
-    int64_t retv = (res / 2 + (res % 2 ? 1 : 0)) * (res % 2 ? 1 : -1);
-    return retv;
-}
-
-uint64_t QBitstream::getbits_expgolomb(int32_t n)
-{
-    uint64_t retv = nextbits_expgolomb(n);
-
-    // _zcount will hold the count of zeros
-    cur_bit += _zcount * 2 + 1;
-    tot_bits += _zcount * 2 + 1;
-    return retv;
-}
-
-uint64_t QBitstream::sgetbits_expgolomb(int32_t n)
-{
-    int64_t retv = snextbits_expgolomb(n);
-
-    // _zcount will hold the count of zeros
-    cur_bit += _zcount * 2 + 1;
-    tot_bits += _zcount * 2 + 1;
-    return retv;
+    return -1;
 }
 
-// write unsigned exp golomb
-int QBitstream::putbits_expgolomb(uint64_t value, int n)
+// Exp-Golomb codes with more than 28 leading zeros, or not held in the read cache
+uint64_t QBitstream::expgolomb_slow(int n)
 {
-    uint64_t M = 0;
-    uint64_t val = value & mask[n];
-    uint64_t val2 = val;
+    // we can't go over 63 zeros for our implementation
+    int maxz = std::min(n, 63);
 
-    val2++;
-    while (val2 > 1)
+    // make sure the longest permitted code is buffered
+    if ((err_code != E_END_OF_DATA) && cur_bit + (maxz * 2 + 1) > (buf_len << BSHIFT))
     {
-        //get the log base 2 of val.
-        val2 >>= 1;
-        M++;
+        fill_buf();
     }
 
-    if(M > 63)
+    int zcount = _countZero(maxz + 1);
+    if (zcount < 0 || cur_bit + (zcount * 2 + 1) > (buf_len << BSHIFT))
     {
-        // we can't go over 64 zeros for our implementation.
-        seterror(E_WRITE_FAILED);
+        // no valid code, or we won't have enough data
+        _eglen = 0;
+        return 0;
     }
-    putbits(0, M);
-    putbits(val + 1, M + 1);
-    return val;
-}
-
-// write signed exp golomb
-int QBitstream::putbits_sexpgolomb(uint64_t value, int n)
-{
-    int64_t tval = (int64_t)value;
-    uint64_t aval = abs(tval);
-    int64_t s = ((value == 0 ) | (aval != tval)) ? 1 : 0;
-    uint64_t scaled = aval * 2 + s;
-    putbits_expgolomb(scaled - 1, n);
-    return value;
-}
-
-// returns 'n' bits as unsigned int with sign extension; does not advance bit pointer (sign extension only if n>1)
-uint64_t QBitstream::snextbits(int n)
-{
-    uint64_t x = nextbits(n);
-    if (n>1 && (x & smask[n])) return x | cmask[n];
-    else return x;
-}
 
-// returns 'n' bits as unsigned int; advances bit pointer
-uint64_t QBitstream::getbits(int n)
-{
-    uint64_t x = nextbits(n);
-    cur_bit += n;
-    tot_bits += n;
-    return (x & mask[n]);
-}
-
-// returns 'n' bits as unsigned int with sign extension; advances bit pointer (sign extension only if n>1)
-uint64_t QBitstream::sgetbits(int n)
-{
-    uint64_t x = getbits(n);
-    if (n>1 && (x & smask[n]))
-    {
-        x = x | cmask[n];
-    }
-    return x;
+    _eglen = zcount * 2 + 1;
+    return peekbits_at(cur_bit + zcount, zcount + 1) - 1;
 }
 
 // probe a float
@@ -490,92 +616,10 @@ double QBitstream::getdouble(void)
 }
 
 // can only write at least one byte to a file at a time; returns the output value
-int QBitstream::putbits(uint64_t value, int n)
+int QBitstream::putbits_slow(uint64_t value, int n)
 {
-    int delta;          // required input shift amount
-    unsigned char *v;   // current byte
-    uint64_t tmp;   // temp value for shifted bits
-    uint64_t val;   // the n-bit value
-
-    val = value & mask[n];
-
-    if (cur_bit + n > (buf_len << BSHIFT)) flush_buf();
-
-    delta = 64 - n - (cur_bit % 8);
-    v = buf + (cur_bit >> BSHIFT);
-    if (delta >= 0) {
-        tmp = val << delta;
-        int write_bytes_count = (64 - delta - 1) >> BSHIFT;
-        switch (write_bytes_count) {
-            case 7:
-                v[0] |= (unsigned char)(tmp >> 56);
-                v[1] = (unsigned char)(tmp >> 48);
-                v[2] = (unsigned char)(tmp >> 40);
-                v[3] = (unsigned char)(tmp >> 32);
-                v[4] = (unsigned char)(tmp >> 24);
-                v[5] = (unsigned char)(tmp >> 16);
-                v[6] = (unsigned char)(tmp >> 8);
-                v[7] = (unsigned char)(tmp);
-                break;
-            case 6:
-                v[0] |= (unsigned char)(tmp >> 56);
-                v[1] = (unsigned char)(tmp >> 48);
-                v[2] = (unsigned char)(tmp >> 40);
-                v[3] = (unsigned char)(tmp >> 32);
-                v[4] = (unsigned char)(tmp >> 24);
-                v[5] = (unsigned char)(tmp >> 16);
-                v[6] = (unsigned char)(tmp >> 8);
-                break;
-            case 5:
-                v[0] |= (unsigned char)(tmp >> 56);
-                v[1] = (unsigned char)(tmp >> 48);
-                v[2] = (unsigned char)(tmp >> 40);
-                v[3] = (unsigned char)(tmp >> 32);
-                v[4] = (unsigned char)(tmp >> 24);
-                v[5] = (unsigned char)(tmp >> 16);
-                break;
-            case 4:
-                v[0] |= (unsigned char)(tmp >> 56);
-                v[1] = (unsigned char)(tmp >> 48);
-                v[2] = (unsigned char)(tmp >> 40);
-                v[3] = (unsigned char)(tmp >> 32);
-                v[4] = (unsigned char)(tmp >> 24);
-                break;
-            case 3:
-                v[0] |= (unsigned char)(tmp >> 56);
-                v[1] = (unsigned char)(tmp >> 48);
-                v[2] = (unsigned char)(tmp >> 40);
-                v[3] = (unsigned char)(tmp >> 32);
-                break;
-            case 2:
-                v[0] |= (unsigned char)(tmp >> 56);
-                v[1] = (unsigned char)(tmp >> 48);
-                v[2] = (unsigned char)(tmp >> 40);
-                break;
-            case 1:
-                v[0] |= (unsigned char)(tmp >> 56);
-                v[1] = (unsigned char)(tmp >> 48);
-                break;
-            default:
-                v[0] |= (unsigned char)(tmp >> 56);
-                break;
-        }
-    }
-    else {
-        tmp = val >> (-delta);
-        v[0] |= (unsigned char)(tmp >> 56);
-        v[1] |= (unsigned char)(tmp >> 48);
-        v[2] |= (unsigned char)(tmp >> 40);
-        v[3] |= (unsigned char)(tmp >> 32);
-        v[4] |= (unsigned char)(tmp >> 24);
-        v[5] |= (unsigned char)(tmp >> 16);
-        v[6] |= (unsigned char)(tmp >> 8);
-        v[7] |= (unsigned char)tmp;
-        v[8] |= (unsigned char)(value << (8+delta));
-    }
-    cur_bit += n;
-    tot_bits += n;
-    return value;
+    flush_buf();
+    return putbits(value, n);
 }
 
 // put a float
@@ -606,19 +650,41 @@ uint64_t QBitstream::getBuffer(uint8_t * buffer, uint64_t size)
 
     // uint64_t retv = size;
     uint64_t total_bytes_read = 0;
-    if(cur_bit % 8)
+    if(cur_bit % 8 || _ep)
     {
-        // we're not bit aligned, so we want to read in 1 byte at a time with getbits
+        // we're not bit aligned (or the device data must be unescaped first), so we want to read
+        // in 1 byte at a time with getbits
         for(int i = 0; i < size; i++)
         {
             buffer[i] = getbits(8);
             total_bytes_read++;
         }
     }
+    else if(!_marks.empty())
+    {
+        // the buffer keeps the marked bytes, so the data goes through it
+        while(size)
+        {
+            if(cur_bit >= (buf_len << BSHIFT))
+            {
+                if(end) break;
+                fill_buf();
+                if(cur_bit >= (buf_len << BSHIFT)) break;
+                continue;
+            }
+            uint64_t k = std::min((uint64_t)(buf_len - (cur_bit >> BSHIFT)), size);
+            memcpy(buffer, buf + (cur_bit >> BSHIFT), k);
+            cur_bit += k << BSHIFT;
+            tot_bits += k << BSHIFT;
+            buffer += k;
+            size -= k;
+            total_bytes_read += k;
+        }
+    }
     else
     {
         // see if we have any available bytes in our buffer
-        uint64_t mbufsize = std::min((uint64_t)(buf_len - (cur_bit >> BSHIFT)), size);
+        uint64_t mbufsize = std::min((uint64_t)std::max(0, buf_len - (cur_bit >> BSHIFT)), size);
         if(mbufsize)
         {
             // starting byte in buffer
@@ -632,14 +698,29 @@ uint64_t QBitstream::getBuffer(uint8_t * buffer, uint64_t size)
 
         if(size)
         {
-            if(_input_device)
+            uint64_t buffered = total_bytes_read;
+            if(_ra)
+            {
+                int64_t br = std::max((int64_t)0, _ra->read(buffer, (int64_t)size));
+                size -= br;
+                total_bytes_read += br;
+            }
+            else if(_input_device || _fd >= 0)
+            {
+                // read the rest straight from the device
+                int64_t br = std::max((int64_t)0, dev_read(buffer, (int64_t)size));
+                size -= br;
+                total_bytes_read += br;
+            }
+            else if(_map)
             {
-                // try to read the rest from the io stream
-                uint64_t br = _input_device->readsome((char*)buffer, (int64_t)size);
+                uint64_t br = std::min(_map_size - _map_pos, size);
+                memcpy(buffer, _map + _map_pos, br);
+                _map_pos += br;
                 size -= br;
                 total_bytes_read += br;
             }
-            else
+            else if(_vector)
             {
                 size_t br = std::min((size_t)(_vector->size() - _vpos), (size_t)size);
                 if(br)
@@ -650,6 +731,19 @@ uint64_t QBitstream::getBuffer(uint8_t * buffer, uint64_t size)
                 size -= br;
                 total_bytes_read += br;
             }
+
+            // the buffer now lies behind the device position, start over past what was read
+            if(total_bytes_read > buffered)
+            {
+                buf_len = 0;
+                cur_bit = 0;
+                invalidate_cache();
+                if(_map)
+                {
+                    buf = _map + _map_pos;
+                    fill_map(0);
+                }
+            }
         }
 
         uint64_t tot_bits_read = total_bytes_read << BSHIFT;
@@ -666,7 +760,8 @@ uint64_t QBitstream::putBuffer(uint8_t * buffer, uint64_t size)
         return 0;
     }
 
-    if(tot_bits % 8)
+    // held output has to stay in front of the data
+    if(cur_bit % 8 || !_marks.empty())
     {
         for(uint64_t i = 0; i < size; i++)
         {
@@ -677,18 +772,20 @@ uint64_t QBitstream::putBuffer(uint8_t * buffer, uint64_t size)
     {
         // we're aligned, just flush the internal buffer and write the entire given buffer directly to the device
         flush_buf();
-        if(_output_device)
+        if(_ep)
         {
-            _output_device->write((char*)buffer, (uint64_t)size);
+            for(uint64_t i = 0; i < size; i += BS_BUF_LEN)
+            {
+                ep_write(buffer + i, (int)std::min(size - i, (uint64_t)BS_BUF_LEN));
+            }
         }
         else
         {
-            _vector->append(buffer, buffer + size);
-            _vpos += size;
+            write_out(buffer, (int64_t)size);
         }
 
         cur_bit = 0;
-        tot_bits += size >> BSHIFT;
+        tot_bits += size << BSHIFT;
     }
 
     return size;
@@ -696,7 +793,13 @@ uint64_t QBitstream::putBuffer(uint8_t * buffer, uint64_t size)
 
 bool QBitstream::canSeek()
 {
-    return true;
+    // RBSP positions have no direct device position; O_DIRECT output only goes forward
+    if(_fd >= 0 && (!_fd_seek || (_fd_direct && _type == BS_OUTPUT))) return false;
+    // a stream read ahead of the parser can not be given back to a pipe
+    if(_input_device && !_sseek) return false;
+    // and there is nothing to seek in without a device
+    if(_fd < 0 && !_input_device && !_output_device && !_vector && !_map) return false;
+    return !_ep;
 }
 
 void QBitstream::seek(int64_t pos)
@@ -707,38 +810,96 @@ void QBitstream::seek(int64_t pos)
         return;
     }
 
-    // reset end
-    end = 0;
-    seterror(E_NONE);
+    if(_type == BS_OUTPUT) flushbits();
+
+    // the bit count moves along, so that align() keeps working from the new position
+    int64_t here = tell();
+    tot_bits += pos - here;
+
+    // a position inside the buffer only moves the cursor
+    int64_t first = here - cur_bit;     // position of buf[0]
+    if(_type == BS_INPUT && pos >= first && pos < first + ((int64_t)buf_len << BSHIFT))
+    {
+        seterror(E_NONE);
+        cur_bit = (int)(pos - first);
+        return;
+    }
 
     if(_type == BS_INPUT)
     {
+        // a mapped file only moves the window
+        if(_map)
+        {
+            end = 0;
+            seterror(E_NONE);
+            _map_pos = std::min((uint64_t)pos >> BSHIFT, _map_size);
+            buf = _map + _map_pos;
+            buf_len = 0;
+            cur_bit = 0;
+            fill_map(0);
+            cur_bit = pos & 7;
+            return;
+        }
+
         // to seek on input, we'll reload the buffer at new stream position
         if(_input_device)
         {
-            if(!_input_device->seekg(pos >> BSHIFT))
+            // the helper thread must leave the device alone while it moves
+            if(_ra) _ra->stop();
+            _input_device->clear();
+            bool ok = (bool)_input_device->seekg(pos >> BSHIFT);
+            if(ok) _spos = pos >> BSHIFT;
+            if(ok && _ra) _ra->restart(_spos);
+            if(!ok)
             {
+                // the stream stays where it was, and so does the buffer; the helper
+                // goes on from the first byte it had not handed over
+                _input_device->clear();
+                if(_ra)
+                {
+                    _input_device->seekg(_ra->pos());
+                    _input_device->clear();
+                    _ra->restart(_ra->pos());
+                }
+                tot_bits -= pos - here;
                 seterror(E_SEEK_FAILED);
                 return;
             }
         }
+        else if(_fd >= 0)
+        {
+            // reads use pread(), so moving is just a new offset
+            if(_ra) _ra->stop();
+            _fd_pos = pos >> BSHIFT;
+            _dbuf_off = _dbuf_len = 0;
+            if(_ra) _ra->restart(_fd_pos);
+        }
         else
         {
             _vpos = pos >> BSHIFT;
         }
-               
+
+        // reset end
+        end = 0;
+        seterror(E_NONE);
+
         // clear the buffer
-        memset(buf, 0, BS_BUF_LEN);
+        memset(buf, 0, _buf_size);
+        invalidate_cache();
 
         int64_t l = 0;
 
-        if(_input_device)
+        if(_ra)
+        {
+            l = _ra->read(buf, _buf_size);
+        }
+        else if(_input_device || _fd >= 0)
         {
-            l = _input_device->readsome((char*)buf, BS_BUF_LEN);
+            l = dev_read(buf, _buf_size);
         }
         else
         {
-            size_t br = std::min((size_t)(_vector->size() - _vpos), (size_t)BS_BUF_LEN);
+            size_t br = std::min((size_t)(_vector->size() - _vpos), (size_t)_buf_size);
             if(br)
             {
                 memcpy(buf, &_vector->data()[_vpos], br);
@@ -751,6 +912,7 @@ void QBitstream::seek(int64_t pos)
         if (l == 0) {
             end = 1;
             seterror(E_END_OF_DATA);
+            buf_len = 0;
             cur_bit = pos & 7;
             return;
         }
@@ -759,33 +921,48 @@ void QBitstream::seek(int64_t pos)
             seterror(E_READ_FAILED);
             return;
         }
-        else if (l < BS_BUF_LEN) {
+        else if (l < _buf_size) {
             end = 1;
-            buf_len = l;
         }
+        buf_len = l;
+        memset(buf + buf_len, 0, BS_BUF_PAD);
 
         cur_bit = pos & 7;
     }
     else
     {
-        // flush and seek
-        flushbits();
-
-        // clear the buffer
-        memset(buf, 0, BS_BUF_LEN);
+        end = 0;
+        seterror(E_NONE);
 
         if(_output_device)
         {
             if(!_output_device->seekp(pos >> BSHIFT))
             {
+                tot_bits -= pos - here;
+                seterror(E_SEEK_FAILED);
+                return;
+            }
+            _spos = pos >> BSHIFT;
+        }
+        else if(_fd >= 0)
+        {
+            if(sys_seek(_fd, pos >> BSHIFT, SEEK_SET) < 0)
+            {
+                tot_bits -= pos - here;
                 seterror(E_SEEK_FAILED);
                 return;
             }
+            _fd_pos = pos >> BSHIFT;
         }
         else
         {
+            // a gap past the end reads as zeros
             _vpos = pos >> BSHIFT;
+            if(_vpos > _vector->size()) _vector->resize(_vpos);
+            if(_vdirect) vec_window();
         }
+        _wacc = 0;
+        _wbits = pos & 7;
         cur_bit = pos & 7;
     }
 }
@@ -797,9 +974,21 @@ int64_t QBitstream::tell()
 
     if(_type == BS_INPUT)
     {
-        if(_input_device)
+        if(_ra)
+        {
+            return _ra->pos() * 8 - ((buf_len << BSHIFT) - cur_bit);
+        }
+        else if(_input_device)
+        {
+            return _spos * 8 - ((buf_len << BSHIFT) - cur_bit);
+        }
+        else if(_map)
+        {
+            return (int64_t)_map_pos * 8 - ((buf_len << BSHIFT) - cur_bit);
+        }
+        else if(_fd >= 0)
         {
-            return _input_device->tellg() * 8 - ((buf_len << BSHIFT) - cur_bit);
+            return _fd_pos * 8 - ((buf_len << BSHIFT) - cur_bit);
         }
         else
         {
@@ -809,7 +998,11 @@ int64_t QBitstream::tell()
 
     if(_output_device)
     {
-        return _output_device->tellp() * 8 + cur_bit;
+        return _spos * 8 + cur_bit;
+    }
+    else if(_fd >= 0)
+    {
+        return _fd_pos * 8 + cur_bit;
     }
     else
     {
@@ -826,13 +1019,29 @@ bool QBitstream::eof()
     u = buf_len - n;
     if(_output_device) {
         return _output_device->eof() && !u;
+    } else if(_map) {
+        return _map_pos >= _map_size && u <= 0;
     } else if(_vector && _type == BS_OUTPUT) {
         // we can go on and on in vector output mode
         return false;
-    } else if(_vector && _type == BS_INPUT) {
-        return _vpos < _vector->size();
+    } else if(_ra) {
+        // the helper thread reaches the end of the device first
+        return u <= 0 && (end || _ra->atend());
+    } else if(_fd >= 0) {
+        if(_type == BS_OUTPUT) return false;
+        // a regular file knows its size; a pipe only ends with a short read
+        struct stat st;
+        return u <= 0 && (end || (_fd_seek && fstat(_fd, &st) == 0 && _fd_pos >= st.st_size));
+    } else if(!_input_device) {
+        return u <= 0;
     }
-    return _input_device->eof() && !u;
+    if(u > 0) return false;
+    if(end) return true;
+
+    // the buffer ended with the data; look for one more byte
+    bool last = _input_device->peek() == std::char_traits<char>::eof();
+    if(!_input_device->bad()) _input_device->clear();
+    return last;
 }
 
 ///////////////////
@@ -842,6 +1051,27 @@ bool QBitstream::eof()
 // returns 'n' bits as unsigned int; does not advance bit pointer
 uint64_t QBitstream::little_nextbits(int n)
 {
+    // make sure we have enough data (so that we can go back)
+    if (cur_bit + n > (buf_len << BSHIFT)) fill_buf();
+
+    if (!(n & 7))
+    {
+        if (!(cur_bit & 7) && cur_bit + n <= (buf_len << BSHIFT))
+        {
+            // byte aligned integers are a single load from the buffer
+            const uint8_t *v = buf + (cur_bit >> BSHIFT);
+            switch (n) {
+                case 8:  return v[0];
+                case 16: return flavor::load_le16(v);
+                case 32: return flavor::load_le32(v);
+                case 64: return flavor::load_le64(v);
+            }
+        }
+
+        // whole bytes: the big endian value with its bytes reversed
+        return n ? flavor::bswap64(nextbits(n)) >> (64 - n) : 0;
+    }
+
     uint64_t x = 0;    // the value we will return
     int bytes = n >> BSHIFT;             // number of bytes to read
     int leftbits = n % 8;           // number of left-over bits to read
@@ -878,21 +1108,9 @@ uint64_t QBitstream::little_snextbits(int n)
 // returns 'n' bits as unsigned int; advances bit pointer
 uint64_t QBitstream::little_getbits(int n)
 {
-    uint64_t x = 0;             // the value we will return
-    int bytes = n >> BSHIFT;    // number of bytes to read
-    int leftbits = n % 8;       // number of bits to read
-    uint64_t byte_x = 0;
-    int i = 0;
-    for (; i < bytes; i++) {
-        byte_x = getbits(8);
-        byte_x <<= (8*i);
-        x |= byte_x;
-    }
-    if (leftbits > 0) {
-        byte_x = getbits(leftbits);
-        byte_x <<= (8*i);
-        x |= byte_x;
-    }
+    uint64_t x = little_nextbits(n);
+    cur_bit += n;
+    tot_bits += n;
     return x;
 }
 
@@ -945,6 +1163,13 @@ double QBitstream::little_getdouble(void)
 // can only write at least one byte to a file at a time; returns the output value
 int QBitstream::little_putbits(uint64_t value, int n)
 {
+    // whole bytes: the big endian value with its bytes reversed
+    if (!(n & 7))
+    {
+        if (n) putbits(flavor::bswap64(value) >> (64 - n), n);
+        return value;
+    }
+
     int bytes = n >> BSHIFT;         // number of bytes to write
     int leftbits = n % 8;           // number of bits to write
     uint64_t byte_x = 0;
@@ -978,18 +1203,29 @@ double QBitstream::little_putdouble(double value)
 // advance by some bits ignoring the value
 void QBitstream::skipbits(int n)
 {
-     int x = n;
-     int buf_size = buf_len << BSHIFT;
+    int x = n;
 
-    // make sure we have enough data
-    while (cur_bit + x > buf_size) {
-        x -= buf_size - cur_bit;
-        cur_bit = buf_size;
-        if (_type == BS_INPUT) fill_buf();
-        else flush_buf();
+    // output skips over zero bits
+    if (_type != BS_INPUT)
+    {
+        for (; x > 0; x -= 64) putbits(0, std::min(x, 64));
+        return;
+    }
+
+    // make sure we have enough data; tot_bits keeps up with cur_bit, refills go by both
+    while (cur_bit + x > (buf_len << BSHIFT)) {
+        if (cur_bit < (buf_len << BSHIFT)) {
+            int k = (buf_len << BSHIFT) - cur_bit;
+            x -= k;
+            cur_bit += k;
+            tot_bits += k;
+        }
+        fill_buf();
+        // out of data, the cursor ends up past the end
+        if (err_code != E_NONE) break;
     }
     cur_bit += x;
-    tot_bits += n;
+    tot_bits += x;
     return;
 }
 
@@ -1043,6 +1279,7 @@ uint64_t QBitstream::nextcode(uint64_t code, int n, int alen)
 
     if (_type == BS_INPUT) {
         if (!alen) {
+            if (nextcode_bits(code, n, s)) return s;
             while (code != nextbits(n)) {
                 if(err_code != E_NONE)
                     break;
@@ -1052,6 +1289,8 @@ uint64_t QBitstream::nextcode(uint64_t code, int n, int alen)
         }
         else {
             s += align(alen);
+            // an invalid alignment is left to the loop, which stops on the error
+            if (alen % 8 == 0 && err_code == E_NONE && nextcode_bytes(code, n, alen, s)) return s;
             while (code != nextbits(n)) {
                 if(err_code != E_NONE)
                     break;
@@ -1065,31 +1304,471 @@ uint64_t QBitstream::nextcode(uint64_t code, int n, int alen)
     return s;
 }
 
-// flush buffer; left-over bits are also output with zero padding
-void QBitstream::flushbits()
+// Byte aligned array kernels, one per common width.  Each decodes k values starting at v.
+template <typename T>
+static void unpack16_be(const uint8_t * v, uint64_t k, T * o)
 {
-    flush_buf();
+    uint64_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    if (sizeof(T) == 2)
+    {
+        // swap the bytes of 8 values at a time
+        for (; i + 8 <= k; i += 8)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i *)(v + 2 * i));
+            x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+            _mm_storeu_si128((__m128i *)(o + i), x);
+        }
+    }
+#endif
+    for (; i < k; i++) o[i] = (T)flavor::load_be16(v + 2 * i);
+}
 
-    if (cur_bit == 0) return;
+// two 12 bit values per 3 bytes, and four 10 bit values per 5 bytes
+template <typename T>
+static void unpack12_be(const uint8_t * v, uint64_t k, T * o)
+{
+    uint64_t i = 0;
+    for (; i + 2 <= k; i += 2, v += 3)
+    {
+        o[i] = (T)((v[0] << 4) | (v[1] >> 4));
+        o[i + 1] = (T)(((v[1] & 0x0f) << 8) | v[2]);
+    }
+    if (i < k) o[i] = (T)((v[0] << 4) | (v[1] >> 4));
+}
 
-    if(_output_device)
+template <typename T>
+static void unpack10_be(const uint8_t * v, uint64_t k, T * o)
+{
+    uint64_t i = 0;
+    for (; i + 4 <= k; i += 4, v += 5)
     {
-        try {
-            _output_device->write((const char *)buf, 1);
+        uint64_t w = flavor::load_be64(v);
+        o[i] = (T)((w >> 54) & 0x3ff);
+        o[i + 1] = (T)((w >> 44) & 0x3ff);
+        o[i + 2] = (T)((w >> 34) & 0x3ff);
+        o[i + 3] = (T)((w >> 24) & 0x3ff);
+    }
+    for (int j = 0; i < k; i++, j += 10) o[i] = (T)((flavor::load_be16(v + (j >> 3)) >> (6 - (j & 7))) & 0x3ff);
+}
+
+// Decode 'count' values of 'width' bits.  Values are unpacked directly from the buffer, as many
+// per refill as it holds; byte aligned values of common widths go through the kernels above.
+template <typename T>
+uint64_t QBitstream::array_read(int width, uint64_t count, T * out, bool little, bool sign)
+{
+    uint64_t done = 0;
+
+    if (width < 1 || width > 64) return 0;
+
+    // little endian values that are not whole bytes keep the per value definition
+    if (little && (width & 7))
+    {
+        for (; done < count; done++) out[done] = (T)(sign ? little_sgetbits(width) : little_getbits(width));
+        return done;
+    }
+
+    while (done < count)
+    {
+        int avail = (buf_len << BSHIFT) - cur_bit;
+        if (avail < width)
+        {
+            fill_buf();
+            avail = (buf_len << BSHIFT) - cur_bit;
+            if (avail < width) break;
         }
-        catch(std::ostream::failure &writeErr) {
+
+        uint64_t k = std::min(count - done, (uint64_t)(avail / width));
+        const uint8_t * v = buf + (cur_bit >> BSHIFT);
+        T * o = out + done;
+
+        // the kernels produce unsigned values that fit T; signed output is extended below
+        bool aligned = !(cur_bit & 7) && width <= (int)(sizeof(T) << BSHIFT);
+        bool kernel = aligned;
+
+        if (aligned && width == 8)
+        {
+            for (uint64_t i = 0; i < k; i++) o[i] = (T)v[i];
+        }
+        else if (aligned && width == 16)
+        {
+            if (little) for (uint64_t i = 0; i < k; i++) o[i] = (T)flavor::load_le16(v + 2 * i);
+            else unpack16_be(v, k, o);
+        }
+        else if (aligned && width == 32)
+        {
+            if (little) for (uint64_t i = 0; i < k; i++) o[i] = (T)flavor::load_le32(v + 4 * i);
+            else for (uint64_t i = 0; i < k; i++) o[i] = (T)flavor::load_be32(v + 4 * i);
+        }
+        else if (aligned && width == 64)
+        {
+            if (little) for (uint64_t i = 0; i < k; i++) o[i] = (T)flavor::load_le64(v + 8 * i);
+            else for (uint64_t i = 0; i < k; i++) o[i] = (T)flavor::load_be64(v + 8 * i);
+        }
+        else if (aligned && width == 12)
+        {
+            unpack12_be(v, k, o);
+        }
+        else if (aligned && width == 10)
+        {
+            unpack10_be(v, k, o);
+        }
+        else
+        {
+            // any width or position: one word load per value
+            int pos = cur_bit;
+            for (uint64_t i = 0; i < k; i++, pos += width)
+            {
+                uint64_t x = peekbits_at(pos, width);
+                if (little) x = flavor::bswap64(x) >> (64 - width);
+                o[i] = (T)(sign ? sext(x, width) : x);
+            }
+            kernel = false;
+        }
+
+        // sign extension of the kernel results, when T is wider than the values
+        if (kernel && sign && width > 1 && width < (int)(sizeof(T) << BSHIFT))
+        {
+            for (uint64_t i = 0; i < k; i++) o[i] = (T)sext((uint64_t)o[i], width);
+        }
+
+        cur_bit += (int)(k * width);
+        tot_bits += k * width;
+        done += k;
+    }
+    return done;
+}
+
+// Decode 'count' Exp-Golomb codes.  Codes are taken from a 64-bit window of the buffer that is
+// reloaded only when the next code does not fit; the buffer bounds are checked once per window.
+// Codes over 57 bits and codes near the end of the data go through getbits_expgolomb().
+template <typename T>
+uint64_t QBitstream::expgolomb_array_read(uint64_t count, T * out, int n, bool sign)
+{
+    uint64_t done = 0;
+    int maxz = std::min(n, 63);
+
+    while (done < count)
+    {
+        int pos = cur_bit;
+        int last = (buf_len << BSHIFT) - 64;    // last position with a full window of data
+
+        while (done < count && pos <= last)
+        {
+            uint64_t w = flavor::load_be64(buf + (pos >> BSHIFT)) << (pos & 7);
+            int valid = 64 - (pos & 7);
+            int len = 0;
+            int z = 0;
+
+            while (done < count)
+            {
+                z = flavor::clz64(w | 1);
+                len = 2 * z + 1;
+                if (len > valid || z > maxz) break;
+
+                uint64_t x = (w >> (64 - len)) - 1;
+                out[done++] = (T)(sign ? expgolomb_signed(x) : x);
+                w <<= len;
+                valid -= len;
+                pos += len;
+            }
+            // a long code or one with too many zeros goes to getbits_expgolomb()
+            if (len > 57 || z > maxz) break;
+        }
+
+        tot_bits += pos - cur_bit;
+        cur_bit = pos;
+        if (done == count) break;
+
+        if (!end && err_code == E_NONE && cur_bit > (buf_len << BSHIFT) - 64)
+        {
+            // near the end of the buffer, refill and go on with whole windows
+            fill_buf();
+            if (cur_bit <= (buf_len << BSHIFT) - 64) continue;
+        }
+
+        // a long code, or the last codes of the data, one at a time
+        uint64_t x = getbits_expgolomb(n);
+        if (!_eglen) break;
+        out[done++] = (T)(sign ? expgolomb_signed(x) : x);
+    }
+    return done;
+}
+
+// The bulk writers keep the bit register and the store position in locals, since the byte
+// stores into buf would otherwise make the compiler reload the members after each of them.
+// The register is handed back before a flush and picked up again after it.
+template <typename T>
+uint64_t QBitstream::array_write(int width, uint64_t count, const T * in, bool little)
+{
+    uint64_t done = 0;
+
+    if (width < 1 || width > 64) return 0;
+
+    // little endian values that are not whole bytes keep the per value definition
+    if (little && (width & 7))
+    {
+        for (; done < count; done++) little_putbits((uint64_t)in[done], width);
+        return done;
+    }
+
+    uint64_t m = mask[width];
+    uint64_t acc = _wacc;
+    int bits = _wbits;
+    uint8_t * p = buf + ((cur_bit - bits) >> BSHIFT);
+
+    for (; done < count; done++)
+    {
+        if (p + 8 > buf + buf_len)
+        {
+            int c = (int)((p - buf) << BSHIFT) + bits;
+            tot_bits += c - cur_bit;
+            cur_bit = c;
+            _wacc = acc;
+            _wbits = bits;
+            flush_buf();
+            acc = _wacc;
+            bits = _wbits;
+            p = buf + ((cur_bit - bits) >> BSHIFT);
+        }
+
+        uint64_t v = (uint64_t)in[done] & m;
+        if (little) v = flavor::bswap64(v) >> (64 - width);
+
+        int r = 64 - bits;
+        if (width < r)
+        {
+            acc = (acc << width) | v;
+            bits += width;
+        }
+        else
+        {
+            flavor::store_be64(p, r == 64 ? v : (acc << r) | (v >> (width - r)));
+            p += 8;
+            acc = v;
+            bits = width - r;
+        }
+    }
+
+    int c = (int)((p - buf) << BSHIFT) + bits;
+    tot_bits += c - cur_bit;
+    cur_bit = c;
+    _wacc = acc;
+    _wbits = bits;
+    return done;
+}
+
+template <typename T>
+uint64_t QBitstream::expgolomb_array_write(uint64_t count, const T * in, int n, bool sign)
+{
+    uint64_t done = 0;
+    uint64_t m = n < 64 ? mask[std::max(n, 0)] : mask[64];
+    uint64_t acc = _wacc;
+    int bits = _wbits;
+    uint8_t * p = buf + ((cur_bit - bits) >> BSHIFT);
+
+    // append 'len' bits (0..64) of 'v' to the register
+    auto put = [&](uint64_t v, int len)
+    {
+        int r = 64 - bits;
+        if (len < r)
+        {
+            acc = (acc << len) | v;
+            bits += len;
+        }
+        else
+        {
+            flavor::store_be64(p, r == 64 ? v : (acc << r) | (v >> (len - r)));
+            p += 8;
+            acc = v;
+            bits = len - r;
+        }
+    };
+
+    for (; done < count; done++)
+    {
+        // a code takes at most 128 bits, so at most three stores
+        if (p + 24 > buf + buf_len)
+        {
+            int c = (int)((p - buf) << BSHIFT) + bits;
+            tot_bits += c - cur_bit;
+            cur_bit = c;
+            _wacc = acc;
+            _wbits = bits;
+            flush_buf();
+            acc = _wacc;
+            bits = _wbits;
+            p = buf + ((cur_bit - bits) >> BSHIFT);
+        }
+
+        uint64_t x = (uint64_t)in[done];
+        if (sign) x = (int64_t)x > 0 ? 2 * x - 1 : 0 - 2 * x;
+        uint64_t k = (x & m) + 1;
+        if (!k)
+        {
             seterror(E_WRITE_FAILED);
-            return;
+            break;
+        }
+
+        int len = 64 - flavor::clz64(k);
+        if (len <= 32) put(k, 2 * len - 1);
+        else
+        {
+            put(0, len - 1);
+            put(k, len);
         }
     }
-    else
+
+    int c = (int)((p - buf) << BSHIFT) + bits;
+    tot_bits += c - cur_bit;
+    cur_bit = c;
+    _wacc = acc;
+    _wbits = bits;
+    return done;
+}
+
+#define FLAVOR_ARRAY(T) \
+    template uint64_t QBitstream::array_read<T>(int, uint64_t, T *, bool, bool); \
+    template uint64_t QBitstream::expgolomb_array_read<T>(uint64_t, T *, int, bool); \
+    template uint64_t QBitstream::array_write<T>(int, uint64_t, const T *, bool); \
+    template uint64_t QBitstream::expgolomb_array_write<T>(uint64_t, const T *, int, bool);
+
+FLAVOR_ARRAY(uint8_t)
+FLAVOR_ARRAY(int8_t)
+FLAVOR_ARRAY(uint16_t)
+FLAVOR_ARRAY(int16_t)
+FLAVOR_ARRAY(uint32_t)
+FLAVOR_ARRAY(int32_t)
+FLAVOR_ARRAY(uint64_t)
+FLAVOR_ARRAY(int64_t)
+
+// Search a byte aligned code of a whole number of bytes directly in the buffer: scan for its
+// last byte, then compare the full code at the matching positions that are on an alen-bit
+// boundary.  Refills keep the bytes of a code that may straddle the end of the buffer.
+bool QBitstream::nextcode_bytes(uint64_t code, int n, int alen, uint64_t &s)
+{
+    if ((n & 7) || n < 8 || n > 64 || (cur_bit & 7) || (code & ~mask[n])) return false;
+
+    int nbytes = n >> BSHIFT;               // code length in bytes
+    int abytes = alen >> BSHIFT;            // alignment in bytes
+    uint8_t key = (uint8_t)code;            // last byte of the code
+
+    for (;;)
+    {
+        int cur = cur_bit >> BSHIFT;
+        const uint8_t * first = buf + cur + nbytes - 1;
+        const uint8_t * last = buf + buf_len;
+        const uint8_t * p = first;
+
+        while (p < last && (p = scanbyte(p, last, key)) < last)
+        {
+            int start = (int)(p - buf) - (nbytes - 1);
+            if ((start - cur) % abytes == 0 && peekbits_at(start << BSHIFT, n) == code)
+            {
+                uint64_t skip = (uint64_t)(start - cur) << BSHIFT;
+                skipbits((int)skip);
+                s += skip;
+                return true;
+            }
+            p++;
+        }
+
+        if (end || err_code != E_NONE)
+        {
+            // out of data; the remaining bytes can not hold the code
+            if (err_code == E_NONE) seterror(E_END_OF_DATA);
+            return true;
+        }
+
+        // skip the positions where the whole code was in the buffer, then refill
+        int left = buf_len - cur - nbytes + 1;
+        if (left > 0)
+        {
+            int skip = ((left + abytes - 1) / abytes) * abytes;
+            skipbits(skip << BSHIFT);
+            s += (uint64_t)skip << BSHIFT;
+        }
+        if (cur_bit + n > (buf_len << BSHIFT)) fill_buf();
+        if (err_code != E_NONE) return true;
+    }
+}
+
+// Search a code at any bit position, a 64-bit word per buffer byte: the code is tested at the
+// 8 bit offsets within the byte against precomputed shifted patterns and masks.
+bool QBitstream::nextcode_bits(uint64_t code, int n, uint64_t &s)
+{
+    if (n < 1 || n > 57 || (code & ~mask[n])) return false;
+
+    uint64_t pat[8];        // the code at bit offset k of the word
+    uint64_t msk[8];        // and its mask
+
+    for (int k = 0; k < 8; k++)
     {
-        (*_vector)[_vpos] = (uint8_t)buf[0];
-        _vpos++;
+        pat[k] = code << (64 - n - k);
+        msk[k] = mask[n] << (64 - n - k);
     }
 
-    buf[0] = 0;
-    cur_bit = 0;    // now only the left-over bits
+    for (;;)
+    {
+        int last = (buf_len << BSHIFT) - n;  // last bit position that holds a whole code
+        int k = cur_bit & 7;
+
+        for (int b = cur_bit >> BSHIFT; (b << BSHIFT) <= last; b++, k = 0)
+        {
+            uint64_t w = flavor::load_be64(buf + b);
+            for (; k < 8; k++)
+            {
+                if ((w & msk[k]) == pat[k])
+                {
+                    int pos = (b << BSHIFT) + k;
+                    if (pos > last) break;
+
+                    s += pos - cur_bit;
+                    skipbits(pos - cur_bit);
+                    return true;
+                }
+            }
+        }
+
+        if (end || err_code != E_NONE)
+        {
+            // out of data; the remaining bits can not hold the code
+            if (err_code == E_NONE) seterror(E_END_OF_DATA);
+            return true;
+        }
+
+        // skip the positions where the whole code was in the buffer, then refill
+        if (last + 1 > cur_bit)
+        {
+            s += last + 1 - cur_bit;
+            skipbits(last + 1 - cur_bit);
+        }
+        if (cur_bit + n > (buf_len << BSHIFT)) fill_buf();
+        if (err_code != E_NONE) return true;
+    }
+}
+
+// flush buffer; left-over bits are also output with zero padding
+void QBitstream::flushbits()
+{
+    // everything goes out, held output too
+    _marks.clear();
+    flush_buf();
+
+    if (cur_bit)
+    {
+        // the left-over bits, zero padded (the padding counts as written)
+        buf[0] = (unsigned char)(_wacc << (8 - _wbits));
+        if (!(_ep ? ep_write(buf, 1) : write_out(buf, 1))) return;
+
+        tot_bits += 8 - _wbits;
+        _wacc = 0;
+        _wbits = 0;
+        cur_bit = 0;
+    }
+
+    // the file gets the partial O_DIRECT block too
+    if (_fd >= 0) fd_finish(true);
 }
 
 // get the next chunk of data from whatever the source is
@@ -1099,25 +1778,54 @@ void QBitstream::fill_buf()
     int	l;	// how many bytes we will fetch (available)
     int	u;	// how many are still unread
 
-    n = (cur_bit >> BSHIFT);
+    // the cursor may be past the end of the data after reading beyond it
+    n = std::min(cur_bit >> BSHIFT, buf_len);
+
+    // the bytes from the oldest mark on stay, up to half of the largest buffer (rewind() then
+    // seeks)
+    if(!_marks.empty())
+    {
+        int64_t m = cur_bit - (int64_t)(tot_bits - _mark_bits);
+        if(m >= 0 && buf_len - (m >> BSHIFT) <= BS_MAP_WINDOW / 2) n = std::min(n, (int)(m >> BSHIFT));
+    }
     u = buf_len - n;
 
+    if(_map)
+    {
+        fill_map(n);
+        return;
+    }
+
     // move unread contents to the beginning of the buffer
     if(u)
     {
         memmove(buf, buf+n, u);
     }
+    invalidate_cache();
 
-    // clear the rest of buf
-    memset(buf + u, 0, n);
+    // a buffer that is mostly kept for marks gets a bigger one, and so do refills that keep
+    // using the whole buffer
+    if (u > _buf_size / 2)
+    {
+        resize_buf(_buf_size * 2, u);
+    }
+    else if (_buf_fills >= 4 && _buf_size < _buf_max)
+    {
+        resize_buf(std::min(_buf_size * 2, _buf_max), u);
+        _buf_fills = 0;
+    }
 
-    if(_input_device)
+    if(_ra)
     {
-        l = _input_device->readsome((char *)(buf + u), n);
+        l = _ra->read(buf + u, _buf_size - u);
     }
-    else
+    else if(_input_device || _fd >= 0)
+    {
+        l = dev_read(buf + u, _buf_size - u);
+    }
+    else if(_vector)
     {
-        size_t br = std::min((size_t)(_vector->size() - _vpos), (size_t)n);
+        size_t br = std::min((size_t)(_vector->size() - _vpos), (size_t)(_buf_size - u));
         if(br)
         {
             memcpy((char *)(buf + u), &_vector->data()[_vpos], br);
@@ -1125,57 +1833,675 @@ void QBitstream::fill_buf()
         _vpos += br;
         l = (int64_t)br;
     }
+    else
+    {
+        // no device (a file that could not be opened)
+        l = 0;
+    }
+
+    // now we are at the first unread byte
+    cur_bit -= n << BSHIFT;
+
+    // check for end of data
+    if (l < 0) {
+        end = 1;
+        seterror(E_READ_FAILED);
+        l = 0;
+    }
+    else if (l == 0) {
+        end = 1;
+        seterror(E_END_OF_DATA);
+    }
+    else if (l < _buf_size - u) {
+        end = 1;
+    }
+    _buf_fills = l == _buf_size - u ? _buf_fills + 1 : 0;
+
+    // NAL payloads are unescaped as they come in
+    if (_ep && l > 0) l = ep_strip(buf + u, l);
+    buf_len = u + l;
+
+    // reads past the end of the data see zeros
+    memset(buf + buf_len, 0, BS_BUF_PAD);
+}
+
+// Memory input is read in place: the window simply moves on to the next part of the memory.
+// A span is not ours to read past or to unescape in place, so its last bytes (or all of it,
+// with emulation prevention on) are copied into a padded buffer instead.
+void QBitstream::fill_map(int n)
+{
+    int u = buf_len - n;
+    uint8_t * next = _map + _map_pos;
+    int l;
+
+    // a span is read in place up to BS_BUF_PAD bytes before its end
+    uint64_t lim = _map_len ? _map_size : _map_size - std::min(_map_size, (uint64_t)BS_BUF_PAD);
+
+    if (_map_len || (!_ep && _map_pos < lim))
+    {
+        // unescaped data is shorter than the input it came from, so the unread bytes may have
+        // to move up to just in front of the next input
+        if (u && _ep && buf + buf_len != next)
+        {
+            memmove(next - u, buf + n, u);
+        }
+        buf = next - u;
+        l = (int)std::min((uint64_t)(BS_MAP_WINDOW - u), lim - _map_pos);
+
+#if !defined(_WIN32)
+        if (_map_len && l > 0)
+        {
+            uintptr_t page = sysconf(_SC_PAGESIZE);
+            uintptr_t a = (uintptr_t)next & ~(page - 1);
+            madvise((void *)a, (uintptr_t)next + l - a, MADV_WILLNEED);
+        }
+#endif
+    }
+    else
+    {
+        // move the unread bytes to the copy, then copy some more
+        size_t need = u + _buf_size + BS_BUF_PAD;
+        if (buf != _sbuf.data())
+        {
+            if (_sbuf.size() < need) _sbuf.resize(need);
+            if (u) memcpy(_sbuf.data(), buf + n, u);
+        }
+        else
+        {
+            if (u) memmove(buf, buf + n, u);
+            if (_sbuf.size() < need) _sbuf.resize(need);
+        }
+        buf = _sbuf.data();
+        l = (int)std::min((uint64_t)_buf_size, _map_size - _map_pos);
+        if (l) memcpy(buf + u, next, l);
+    }
+    invalidate_cache();
+
+    // now we are at the first unread byte
+    cur_bit -= n << BSHIFT;
+    _map_pos += l;
 
     // check for end of data
     if (l == 0) {
         end = 1;
         seterror(E_END_OF_DATA);
-        cur_bit &= 7;
-        return;
     }
-    else if (l < 0) {
+    else if (_map_pos >= _map_size) {
         end = 1;
-        seterror(E_READ_FAILED);
+    }
+
+    if (_ep && l > 0) l = ep_strip(buf + u, l);
+    buf_len = u + l;
+
+    // reads past the end of the data see zeros; in a file mapping they may be hidden behind
+    // unescaped data
+    if (buf == _sbuf.data() || (_ep && end && _map_len)) memset(buf + buf_len, 0, BS_BUF_PAD);
+}
+
+// Remove the 03 of every 00 00 03 sequence.  The data between zero pairs is moved down in one
+// piece; the zero count is carried over so sequences split across reads are found too.
+int QBitstream::ep_strip(uint8_t * p, int l)
+{
+    const uint8_t * s = p;
+    const uint8_t * e = p + l;
+    uint8_t * d = p;
+    int zeros = _ep_zeros;
+
+    while (s < e)
+    {
+        if (zeros == 2)
+        {
+            // the byte after 00 00
+            if (*s == 3)
+            {
+                _ep_map.push_back(_ep_rbsp + (d - p));
+                _ep_count++;
+                s++;
+                zeros = 0;
+                continue;
+            }
+            if (*s) zeros = 0;
+            *d++ = *s++;
+            continue;
+        }
+        if (zeros == 1)
+        {
+            // a pair may start at the last byte of the previous run
+            zeros = *s ? 0 : 2;
+            *d++ = *s++;
+            continue;
+        }
+
+        // copy up to and including the next zero pair
+        const uint8_t * z = scanzeros(s, e);
+        if (z < e)
+        {
+            z += 2;
+            zeros = 2;
+        }
+        else zeros = !e[-1];
+
+        if (d != s) memmove(d, s, z - s);
+        d += z - s;
+        s = z;
+    }
+
+    _ep_zeros = zeros;
+    _ep_rbsp += d - p;
+    return (int)(d - p);
+}
+
+void QBitstream::setEmulationPrevention(bool on)
+{
+    if (on == _ep) return;
+
+    if (_type == BS_OUTPUT)
+    {
+        // the mode applies to the data written from now on
+        if (on) setDirectWrite(false);
+        flush_buf();
+        _ep = on;
+        _ep_zeros = 0;
         return;
     }
-    else if (l < n) {
-        end = 1;
-        buf_len = u+l;
+
+    _ep = on;
+    if (!on) return;
+
+    _ep_zeros = 0;
+    _ep_count = 0;
+    _ep_rbsp = 0;
+    _ep_map.clear();
+    _ep_origin = tot_bits - (cur_bit & 7);
+
+    int cur = std::min(cur_bit >> BSHIFT, buf_len);
+    if (_map && !_map_len && buf != _sbuf.data())
+    {
+        // a span can not be changed; read on from a copy of the unread part
+        _map_pos -= buf_len - cur;
+        cur_bit -= cur << BSHIFT;
+        buf_len = 0;
+        fill_map(0);
+        return;
     }
-    // now we are at the first byte
-    cur_bit &= 7;
+
+    // unescape the unread part of the buffer; past a mapped window is input still to be read
+    buf_len = cur + ep_strip(buf + cur, buf_len - cur);
+    if (!_map || buf == _sbuf.data() || end) memset(buf + buf_len, 0, BS_BUF_PAD);
+    invalidate_cache();
 }
 
-// output the buffer excluding the left-over bits.
-void QBitstream::flush_buf()
+uint64_t QBitstream::rawpos(uint64_t pos)
+{
+    if (pos < _ep_origin) return pos >> BSHIFT;
+
+    // every removed byte before the RBSP byte holding 'pos' moves it one byte further
+    uint64_t r = (pos - _ep_origin) >> BSHIFT;
+
+    // a byte that is not buffered yet may still have a removed byte in front of it
+    if (_ep && r >= _ep_rbsp && !end && cur_bit >= (buf_len << BSHIFT)) fill_buf();
+    uint64_t k = std::upper_bound(_ep_map.begin(), _ep_map.end(), r) - _ep_map.begin();
+    return (_ep_origin >> BSHIFT) + r + k;
+}
+
+QBitstream::Mark QBitstream::mark()
+{
+    Mark m;
+    m.pos = canSeek() ? tell() : -1;
+    m.bits = tot_bits;
+    m.err = err_code;
+
+    if(_type == BS_INPUT) hold(tot_bits);
+    return m;
+}
+
+// The buffer holds bit 'tot_bits - cur_bit + i' of the input at bit i; refills, seeks and
+// getBuffer() keep to that, so a mark that maps into the buffer can be read from there.
+bool QBitstream::rewind(const Mark & m)
+{
+    if(_type != BS_INPUT) return false;
+
+    int64_t b = cur_bit - (int64_t)(tot_bits - m.bits);
+    // past the end of the data, the buffer holds the rest of it
+    if(b >= 0 && (b <= (buf_len << BSHIFT) || end))
+    {
+        cur_bit = (int)b;
+        tot_bits = m.bits;
+        seterror(m.err);
+        return true;
+    }
+
+    if(m.pos < 0 || !canSeek()) return false;
+    Error_t e = err_code;
+    seek(m.pos);
+    if(err_code == E_SEEK_FAILED)
+    {
+        // the reader stays where it was
+        seterror(e);
+        return false;
+    }
+    if(err_code == E_READ_FAILED) return false;
+    tot_bits = m.bits;
+    return true;
+}
+
+void QBitstream::unmark(const Mark & m)
+{
+    if(_type == BS_INPUT) release(m.bits);
+}
+
+void QBitstream::hold(uint64_t bits)
+{
+    _mark_bits = _marks.empty() ? bits : std::min(_mark_bits, bits);
+    _marks.push_back(bits);
+}
+
+// marks come and go in any order; there are few of them
+void QBitstream::release(uint64_t bits)
+{
+    auto i = std::find(_marks.begin(), _marks.end(), bits);
+    if(i == _marks.end()) return;
+    *i = _marks.back();
+    _marks.pop_back();
+    _mark_bits = _marks.empty() ? 0 : *std::min_element(_marks.begin(), _marks.end());
+}
+
+QBitstream::Checkpoint QBitstream::checkpoint()
+{
+    Checkpoint cp;
+    cp.bits = tot_bits;
+    cp.acc = _wacc;
+    cp.wbits = _wbits;
+    cp.size = _vector ? _vector->size() : 0;
+    cp.err = err_code;
+
+    if(_type == BS_OUTPUT)
+    {
+        // the register bits go into the buffer later, so they are held from their first on
+        hold(tot_bits - _wbits);
+    }
+    return cp;
+}
+
+// The buffer (with the register) holds bit 'tot_bits - cur_bit + i' of the output at bit i, and
+// flush_buf() keeps the bytes from the oldest checkpoint on, so the bits before a checkpoint
+// that maps into the buffer are still there.
+bool QBitstream::rollback(const Checkpoint & cp)
 {
-    int l = (cur_bit >> BSHIFT);     // number of bytes written already
+    if(_type != BS_OUTPUT) return false;
 
+    int64_t b = cur_bit - (int64_t)(tot_bits - cp.bits);
+    if(b - cp.wbits < 0 || b > cur_bit) return false;
+
+    cur_bit = (int)b;
+    tot_bits = cp.bits;
+    _wacc = cp.acc;
+    _wbits = cp.wbits;
+    seterror(cp.err);
+
+    // direct writes put held bytes in the vector already; drop the ones that are gone now
+    if(_vdirect && _vector->size() > cp.size)
+    {
+        _vector->resize(std::max(cp.size, _vpos + ((cur_bit - _wbits) >> BSHIFT)));
+    }
+    return true;
+}
+
+void QBitstream::commit(const Checkpoint & cp)
+{
+    if(_type == BS_OUTPUT) release(cp.bits - cp.wbits);
+}
+
+// write 'l' bytes to the output device
+bool QBitstream::write_out(const uint8_t * p, int64_t l)
+{
     if(_output_device)
     {
         try {
-            _output_device->write((const char *)buf, l);
+            _output_device->write((const char *)p, l);
+            _spos += l;
         }
         catch(std::ostream::failure &writeErr) {
             seterror(E_WRITE_FAILED);
-            return;
+            return false;
+        }
+    }
+    else if(_fd >= 0)
+    {
+        if(!fd_write(p, l))
+        {
+            seterror(E_WRITE_FAILED);
+            return false;
         }
     }
+    else if(!_vector)
+    {
+        // no device (a descriptor that was not valid)
+        seterror(E_WRITE_FAILED);
+        return false;
+    }
     else
     {
-        for(int i = 0; i < l; i++)
+        // overwrite what a seek went back over and append the rest; in direct mode the bytes
+        // are already in place
+        size_t k = std::min((size_t)l, _vector->size() - _vpos);
+        if(p != _vector->data() + _vpos)
         {
-            (*_vector)[_vpos] = (uint8_t)buf[i];
-            _vpos += 1;
+            memcpy(_vector->data() + _vpos, p, k);
+            _vector->append(p + k, p + l);
         }
+        else if(k < (size_t)l)
+        {
+            _vector->resize_for_overwrite(_vpos + l);
+        }
+        _vpos += l;
+        if(_vdirect) vec_window();
     }
+    return true;
+}
+
+void QBitstream::vec_window(int held)
+{
+    // 8 bytes of slack for the whole bytes of the bit register that flush_buf() adds
+    size_t need = _vpos + held + _buf_size + 8;
+    if(_vector->capacity() < need) _vector->reserve(std::max(need, _vector->capacity() * 2));
+    buf = _vector->data() + _vpos;
+    buf_len = (int)std::min(_vector->capacity() - _vpos - 8, (size_t)BS_MAP_WINDOW);
+}
 
-    // are there any left-over bits?
-    if (cur_bit & 0x7) {
-        buf[0] = buf[l];                // copy the left-over bits
-        memset(buf+1, 0, BS_BUF_LEN-1); // zero-out rest of buffer
+void QBitstream::setDirectWrite(bool on)
+{
+    if(_type != BS_OUTPUT || !_vector || _ep) on = false;
+    if(on == _vdirect || !_marks.empty()) return;
+
+    // the left-over bits stay in the bit register, the buffer itself is empty after a flush
+    flush_buf();
+    if(on)
+    {
+        buf_free(buf);
+        _vdirect = true;
+        vec_window();
+    }
+    else
+    {
+        _vdirect = false;
+        buf = NULL;
+        resize_buf(_buf_size, 0);
+        buf_len = _buf_size;
+    }
+}
+
+void QBitstream::reserve_bits(uint64_t n)
+{
+    if(_type == BS_OUTPUT && _vector)
+    {
+        // a move of the vector only keeps its contents, not the buffered bytes past them
+        if(_vdirect) flush_buf();
+        _vector->reserve(_vpos + ((cur_bit + n + 7) >> BSHIFT));
+        if(_vdirect) vec_window();
+    }
+}
+
+// Whole reads: readsome() returns nothing once the stream buffer is empty, and a pipe may return
+// less than asked for before its end, so only a short read at the end of the data ends it.
+int64_t QBitstream::dev_read(uint8_t * p, int64_t n)
+{
+    if(_fd >= 0)
+    {
+        return fd_read(p, n);
+    }
+    if(!_input_device) return -1;
+
+    _input_device->read((char *)p, n);
+    if(_input_device->bad()) return -1;
+    int64_t got = _input_device->gcount();
+    _spos += got;
+
+    // keep tellg() working; the end is remembered in 'end'
+    _input_device->clear();
+    return got;
+}
+
+// O_DIRECT reads whole aligned blocks into _dbuf and copies out the part asked for
+int64_t QBitstream::fd_read(uint8_t * p, int64_t n)
+{
+    int64_t got = 0;
+    while(got < n)
+    {
+        int64_t r;
+        if(_fd_direct)
+        {
+            if(_dbuf_off >= _dbuf_len)
+            {
+                int64_t base = _fd_pos & ~(int64_t)(BS_DIRECT_ALIGN - 1);
+                r = sys_read(_fd, _dbuf, _dbuf_size, base);
+                if(r < 0) return got ? got : -1;
+                _dbuf_off = (int)(_fd_pos - base);
+                _dbuf_len = (int)r;
+                if(_dbuf_off >= _dbuf_len) break;
+            }
+            r = std::min(n - got, (int64_t)(_dbuf_len - _dbuf_off));
+            memcpy(p + got, _dbuf + _dbuf_off, (size_t)r);
+            _dbuf_off += (int)r;
+        }
+        else
+        {
+            r = sys_read(_fd, p + got, n - got, _fd_seek ? _fd_pos : -1);
+            if(r < 0) return got ? got : -1;
+            if(r == 0) break;
+        }
+        _fd_pos += r;
+        got += r;
+    }
+    return got;
+}
+
+// O_DIRECT writes go out in whole blocks of _dbuf
+bool QBitstream::fd_write(const uint8_t * p, int64_t n)
+{
+    if(!_fd_direct)
+    {
+        if(!sys_write(_fd, p, n)) return false;
+        _fd_pos += n;
+        return true;
     }
-    else memset(buf, 0, BS_BUF_LEN);    // zero-out entire buffer
-    // keep left-over bits only
-    cur_bit &= 7;
+
+    while(n > 0)
+    {
+        int k = (int)std::min(n, (int64_t)(_dbuf_size - _dbuf_len));
+        memcpy(_dbuf + _dbuf_len, p, k);
+        _dbuf_len += k;
+        _fd_pos += k;
+        p += k;
+        n -= k;
+        if(_dbuf_len == _dbuf_size)
+        {
+            if(!sys_write(_fd, _dbuf, _dbuf_size)) return false;
+            _dbuf_len = 0;
+        }
+    }
+    return true;
+}
+
+// the last partial block can only be written with O_DIRECT off; the descriptor gets its flags
+// back afterwards, as it may be the caller's
+void QBitstream::fd_finish(bool keep)
+{
+    if(_fd < 0 || !_fd_direct || !_dbuf_len) return;
+#if defined(O_DIRECT)
+    int flags = fcntl(_fd, F_GETFL);
+    fcntl(_fd, F_SETFL, flags & ~O_DIRECT);
+#endif
+    bool ok = sys_write(_fd, _dbuf, _dbuf_len);
+#if defined(O_DIRECT)
+    fcntl(_fd, F_SETFL, flags);
+#endif
+    if(!ok) seterror(E_WRITE_FAILED);
+
+    // a kept block is written again, whole and aligned, once it fills up
+    if(!ok || !keep || sys_seek(_fd, -(int64_t)_dbuf_len, SEEK_CUR) < 0) _dbuf_len = 0;
+}
+
+// Insert an 03 in front of every byte <= 3 that follows 00 00.  The data between zero pairs
+// goes out in one piece; the zero count is carried over so pairs split across flushes are
+// escaped too.
+bool QBitstream::ep_write(const uint8_t * p, int l)
+{
+    static const uint8_t three = 3;
+    const uint8_t * e = p + l;
+    const uint8_t * s = p;      // first byte not written yet
+    int zeros = _ep_zeros;
+
+    while (p < e)
+    {
+        if (zeros == 2 && *p <= 3)
+        {
+            if (!write_out(s, (int)(p - s)) || !write_out(&three, 1)) return false;
+            _ep_count++;
+            s = p;
+            zeros = 0;
+        }
+        if (zeros)
+        {
+            zeros = *p ? 0 : zeros + 1;
+            p++;
+            continue;
+        }
+
+        // skip to just after the next zero pair
+        const uint8_t * z = scanzeros(p, e);
+        if (z < e)
+        {
+            p = z + 2;
+            zeros = 2;
+        }
+        else
+        {
+            zeros = !e[-1];
+            p = e;
+        }
+    }
+
+    _ep_zeros = zeros;
+    return write_out(s, (int)(e - s));
+}
+
+// output the buffer excluding the left-over bits.
+void QBitstream::flush_buf()
+{
+    int l = (cur_bit - _wbits) >> BSHIFT;  // number of bytes stored already
+
+    // the whole bytes of the register go out too
+    for (; _wbits >= 8; _wbits -= 8)
+    {
+        buf[l++] = (unsigned char)(_wacc >> (_wbits - 8));
+    }
+
+    // the bytes from the oldest checkpoint on are held, unless the buffer can not grow for them
+    int k = l;
+    if (!_marks.empty())
+    {
+        int64_t c = cur_bit - (int64_t)(tot_bits - _mark_bits);
+        if (c >= 0) k = std::min(k, (int)(c >> BSHIFT));
+
+        // at most half of the largest buffer, so that there is room to go on
+        if (l - k > BS_MAP_WINDOW / 2) k = l;
+    }
+
+    bool ok;
+    if (_vdirect && k < l)
+    {
+        // the bytes are in place in the vector; step back over the held ones
+        ok = write_out(buf, l);
+        if (ok)
+        {
+            _vpos -= l - k;
+            vec_window(l - k);
+        }
+    }
+    else
+    {
+        ok = _ep ? ep_write(buf, k) : write_out(buf, k);
+        if (ok && k < l) memmove(buf, buf + k, l - k);
+    }
+
+    if (!ok)
+    {
+        // on a write error the buffered bytes are dropped (the error is set), so that the
+        // puts that follow still find room
+        cur_bit = _wbits;
+        return;
+    }
+
+    // keep the held bytes and the left-over bits (in the register)
+    cur_bit -= k << BSHIFT;
+
+    // flushes that keep finding the buffer full get a bigger one, and so does a buffer that is
+    // mostly held for checkpoints
+    _buf_fills = k >= buf_len - 8 ? _buf_fills + 1 : 0;
+    if (_vdirect) return;
+    if (l - k > _buf_size / 2)
+    {
+        resize_buf(_buf_size * 2, l - k);
+        buf_len = _buf_size;
+    }
+    else if (_buf_fills >= 4 && _buf_size < _buf_max)
+    {
+        resize_buf(std::min(_buf_size * 2, _buf_max), l - k);
+        buf_len = _buf_size;
+        _buf_fills = 0;
+    }
+}
+
+// replace the buffer with a zeroed one of 'size' bytes (plus padding), keeping its first 'keep' bytes
+void QBitstream::resize_buf(int size, int keep)
+{
+    size = std::max(64, std::min(size, BS_MAP_WINDOW));
+    unsigned char * b = buf_alloc(size + BS_BUF_PAD);
+    memset(b, 0, size + BS_BUF_PAD);
+    if (keep) memcpy(b, buf, keep);
+    buf_free(buf);
+    buf = b;
+    _buf_size = size;
+    invalidate_cache();
+}
+
+void QBitstream::setBufferGrowth(int maxsize)
+{
+    _buf_max = std::min(maxsize, BS_MAP_WINDOW);
+}
+
+void QBitstream::setReadAhead(int blocks)
+{
+    if (_type != BS_INPUT || (!_input_device && _fd < 0)) return;
+
+    if (_ra)
+    {
+        // a pipe can not be given back what was read ahead of the parser
+        if ((_fd >= 0 && !_fd_seek) || (_input_device && !_sseek)) return;
+
+        // hand the device back at the position of the next unbuffered byte
+        int64_t pos = _ra->pos();
+        delete _ra;
+        _ra = NULL;
+        if (_fd >= 0)
+        {
+            _fd_pos = pos;
+            _dbuf_off = _dbuf_len = 0;
+        }
+        else
+        {
+            _input_device->clear();
+            _input_device->seekg(pos);
+            _spos = pos;
+        }
+    }
+    if (blocks <= 0) return;
+
+    // whole reads on the helper thread; a short one is the end of the device
+    flavor::ReadAhead::Source source = [this](uint8_t * p, int n) -> int64_t
+    {
+        return dev_read(p, n);
+    };
+    _ra = new flavor::ReadAhead(source, blocks, _buf_size, _fd >= 0 ? _fd_pos : _spos);
 }
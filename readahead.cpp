@@ -0,0 +1,142 @@
+// Background read-ahead
+#include <string.h>
+#include <algorithm>
+
+#include "freadahead.h"
+
+namespace flavor {
+
+ReadAhead::ReadAhead(Source source, int blocks, int size, int64_t pos)
+    : _source(source), _size(size), _filled(0), _taken(0), _stop(false), _cwait(false), _pwait(false),
+      _off(0), _pos(pos), _done(false)
+{
+    // at least two blocks, so that one can be read while the other is filled
+    _ring.resize(std::max(blocks, 2));
+    for (Block & b : _ring)
+    {
+        b.data.resize(size);
+        b.len = 0;
+    }
+    start();
+}
+
+ReadAhead::~ReadAhead()
+{
+    stop();
+}
+
+void ReadAhead::start()
+{
+    _thread = std::thread(&ReadAhead::run, this);
+}
+
+void ReadAhead::stop()
+{
+    _stop = true;
+    {
+        std::lock_guard<std::mutex> g(_lock);
+        _wake.notify_all();
+    }
+    if (_thread.joinable()) _thread.join();
+}
+
+void ReadAhead::restart(int64_t pos)
+{
+    stop();
+    _filled = 0;
+    _taken = 0;
+    _stop = false;
+    _off = 0;
+    _pos = pos;
+    _done = false;
+    start();
+}
+
+// fill blocks until the end of the source, or until stopped
+void ReadAhead::run()
+{
+    uint64_t n = _filled;
+    uint64_t count = _ring.size();
+
+    while (!_stop)
+    {
+        if (n - _taken == count)
+        {
+            // all blocks are full, wait for the consumer to give one back
+            std::unique_lock<std::mutex> l(_lock);
+            _pwait = true;
+            while (n - _taken == count && !_stop) _wake.wait(l);
+            _pwait = false;
+            continue;
+        }
+
+        Block & b = _ring[n % count];
+        b.len = _source(b.data.data(), _size);
+        _filled = ++n;
+        if (_cwait)
+        {
+            std::lock_guard<std::mutex> g(_lock);
+            _wake.notify_all();
+        }
+
+        // a short block is the last one
+        if (b.len < _size) break;
+    }
+}
+
+// the block the consumer is in, waiting for the thread to fill it if needed
+ReadAhead::Block & ReadAhead::current()
+{
+    uint64_t t = _taken;
+    if (_filled == t)
+    {
+        std::unique_lock<std::mutex> l(_lock);
+        _cwait = true;
+        while (_filled == t) _wake.wait(l);
+        _cwait = false;
+    }
+    return _ring[t % _ring.size()];
+}
+
+bool ReadAhead::atend()
+{
+    return _done || current().len <= 0;
+}
+
+int64_t ReadAhead::read(uint8_t * p, int64_t n)
+{
+    int64_t got = 0;
+
+    while (got < n && !_done)
+    {
+        uint64_t t = _taken;
+        Block & b = current();
+        if (b.len < 0)
+        {
+            _done = true;
+            return got ? got : -1;
+        }
+
+        int64_t k = std::min(n - got, b.len - _off);
+        memcpy(p + got, b.data.data() + _off, (size_t)k);
+        _off += k;
+        _pos += k;
+        got += k;
+
+        if (_off == b.len)
+        {
+            // give the block back
+            if (b.len < _size) _done = true;
+            _off = 0;
+            _taken = t + 1;
+            if (_pwait)
+            {
+                std::lock_guard<std::mutex> g(_lock);
+                _wake.notify_all();
+            }
+        }
+    }
+    return got;
+}
+
+} // namespace flavor
@@ -0,0 +1,147 @@
+// CABAC decoding against a reference encoder
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include <flavor.h>
+
+static int fails = 0;
+#define CHECK(c) do { if (!(c)) { fails++; printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #c); } } while (0)
+
+using flavor::CabacDecoder;
+
+// the arithmetic encoder of H.264 9.3.4, with the decoder's context tables
+struct Encoder
+{
+    QBitstream * bs;
+    uint32_t low = 0, range = 510;
+    int outstanding = 0;
+    bool first = true;
+
+    void put(int b)
+    {
+        if (!first) bs->putbits(b, 1);
+        first = false;
+        for (; outstanding; outstanding--) bs->putbits(!b, 1);
+    }
+
+    void renorm()
+    {
+        while (range < 256)
+        {
+            if (low < 256) put(0);
+            else if (low >= 512) { low -= 512; put(1); }
+            else { low -= 256; outstanding++; }
+            range <<= 1;
+            low <<= 1;
+        }
+    }
+
+    void decision(uint8_t & ctx, int bin)
+    {
+        uint32_t lps = CabacDecoder::lps_range[ctx >> 1][(range >> 6) & 3];
+        range -= lps;
+        if (bin != (ctx & 1))
+        {
+            low += range;
+            range = lps;
+            ctx = CabacDecoder::next_lps[ctx];
+        }
+        else ctx = CabacDecoder::next_mps[ctx];
+        renorm();
+    }
+
+    void bypass(int bin)
+    {
+        low <<= 1;
+        if (bin) low += range;
+        if (low >= 1024) { put(1); low -= 1024; }
+        else if (low < 512) put(0);
+        else { low -= 512; outstanding++; }
+    }
+
+    void terminate(int bin)
+    {
+        range -= 2;
+        if (!bin)
+        {
+            renorm();
+            return;
+        }
+        low += range;
+        range = 2;
+        renorm();
+        put((low >> 9) & 1);
+        bs->putbits(((low >> 7) & 3) | 1, 2);
+    }
+};
+
+struct Bin
+{
+    int kind;       // 0 decision, 1 bypass, 2 bypass bits, 3 terminate
+    int ctx;
+    uint32_t value;
+    int n;
+};
+
+// random decisions, bypass bins and terminating bins decode as they were encoded
+static void round_trip()
+{
+    static const int8_t mn[4][2] = {{20, -15}, {2, 54}, {3, 74}, {-28, 127}};
+    uint8_t ectx[4], dctx[4];
+    CabacDecoder::init_contexts(ectx, mn, 4, 26);
+    CabacDecoder::init_contexts(dctx, mn, 4, 26);
+
+    std::vector<Bin> bins;
+    uint32_t x = 7;
+    for (int i = 0; i < 20000; i++)
+    {
+        x = x * 1103515245 + 12345;
+        Bin b;
+        b.kind = (x >> 28) < 12 ? 0 : (x >> 28) < 14 ? 1 : (x >> 28) < 15 ? 2 : 3;
+        b.ctx = (x >> 8) & 3;
+        b.n = 1 + ((x >> 4) & 15);
+        // skewed toward the MPS of each context, as real data is
+        b.value = b.kind == 2 ? (x >> 10) & ((1u << b.n) - 1) : b.kind == 3 ? 0 : ((x >> 12) & 7) == 0;
+        bins.push_back(b);
+    }
+    bins.push_back(Bin{3, 0, 1, 0});
+
+    flavor::SmallVector<uint8_t> v;
+    {
+        QBitstream w(&v, BS_OUTPUT);
+        Encoder e;
+        e.bs = &w;
+        for (const Bin & b : bins)
+        {
+            if (b.kind == 0) e.decision(ectx[b.ctx], b.value);
+            else if (b.kind == 1) e.bypass(b.value & 1);
+            else if (b.kind == 2) for (int k = b.n - 1; k >= 0; k--) e.bypass((b.value >> k) & 1);
+            else e.terminate(b.value);
+        }
+        w.putbits(1, 1);    // rbsp_stop_one_bit
+        w.flushbits();
+    }
+
+    QBitstream r(&v, BS_INPUT);
+    CabacDecoder d(&r);
+    bool same = true;
+    for (const Bin & b : bins)
+    {
+        uint32_t got;
+        if (b.kind == 0) got = d.decode_decision(dctx[b.ctx]);
+        else if (b.kind == 1) got = d.decode_bypass();
+        else if (b.kind == 2) got = d.decode_bypass_bits(b.n);
+        else got = d.decode_terminate();
+        same &= got == (b.kind == 1 ? b.value & 1 : b.value);
+    }
+    CHECK(same);
+    CHECK(memcmp(ectx, dctx, sizeof(ectx)) == 0);
+}
+
+int main()
+{
+    round_trip();
+    printf(fails ? "FAILED\n" : "OK\n");
+    return fails != 0;
+}
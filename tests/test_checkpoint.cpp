@@ -0,0 +1,85 @@
+// Trial encoding with checkpoints
+#include <stdio.h>
+#include <string.h>
+#include <sstream>
+
+#include <flavor.h>
+
+static int fails = 0;
+#define CHECK(c) do { if (!(c)) { fails++; printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #c); } } while (0)
+
+// a rollback over more output than the buffer holds, into a vector and a stream
+static void rollback_past_buffer()
+{
+    flavor::SmallVector<uint8_t> v;
+    std::ostringstream os;
+    QBitstream a(&v, BS_OUTPUT, false, 64);
+    QBitstream b(&os, false, 64);
+
+    for (QBitstream * w : {&a, &b})
+    {
+        w->putbits(0x5, 3);
+        QBitstream::Checkpoint cp = w->checkpoint();
+        for (int i = 0; i < 1000; i++) w->putbits(0xff, 8);
+        CHECK(w->getpos() == 3 + 8000);
+        CHECK(w->rollback(cp));
+        CHECK(w->getpos() == 3);
+        w->putbits(0x1f, 5);
+        w->flushbits();
+        CHECK(w->geterror() == E_NONE);
+    }
+
+    CHECK(v.size() == 1 && v[0] == 0xbf);
+    CHECK(os.str() == "\xbf");
+}
+
+// a kept trial goes out whole, and a rollback fails once its output went out
+static void commit_and_flush()
+{
+    flavor::SmallVector<uint8_t> v;
+    QBitstream w(&v, BS_OUTPUT, false, 64);
+
+    QBitstream::Checkpoint cp = w.checkpoint();
+    for (int i = 0; i < 200; i++) w.putbits(i, 8);
+    w.commit(cp);
+
+    cp = w.checkpoint();
+    w.putbits(0xaa, 8);
+    w.flushbits();
+    CHECK(!w.rollback(cp));
+    CHECK(w.getpos() == 201 * 8);
+
+    CHECK(v.size() == 201);
+    bool same = true;
+    for (int i = 0; i < 200; i++) same &= v[i] == i;
+    CHECK(same);
+    CHECK(v[200] == 0xaa);
+}
+
+// nested checkpoints: rolling back the inner one keeps the outer one usable
+static void nested()
+{
+    flavor::SmallVector<uint8_t> v;
+    QBitstream w(&v, BS_OUTPUT, false, 64);
+
+    QBitstream::Checkpoint outer = w.checkpoint();
+    w.putbits(0x12, 8);
+    QBitstream::Checkpoint inner = w.checkpoint();
+    for (int i = 0; i < 300; i++) w.putbits(0x34, 8);
+    CHECK(w.rollback(inner));
+    w.putbits(0x56, 8);
+    CHECK(w.rollback(outer));
+    w.putbits(0x78, 8);
+    w.flushbits();
+
+    CHECK(v.size() == 1 && v[0] == 0x78);
+}
+
+int main()
+{
+    rollback_past_buffer();
+    commit_and_flush();
+    nested();
+    printf(fails ? "FAILED\n" : "OK\n");
+    return fails != 0;
+}
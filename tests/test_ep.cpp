@@ -0,0 +1,77 @@
+// Emulation prevention (00 00 03) insertion and removal
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include <flavor.h>
+
+static int fails = 0;
+#define CHECK(c) do { if (!(c)) { fails++; printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #c); } } while (0)
+
+// a known RBSP, escaped and unescaped again
+static void known_bytes()
+{
+    const uint8_t rbsp[] = {0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x25};
+    const uint8_t nal[] = {0x00, 0x00, 0x03, 0x01, 0x00, 0x00, 0x03, 0x00, 0x25};
+
+    flavor::SmallVector<uint8_t> v;
+    {
+        QBitstream w(&v, BS_OUTPUT);
+        w.setEmulationPrevention(true);
+        for (uint8_t b : rbsp) w.putbits(b, 8);
+        w.flushbits();
+        CHECK(w.epbytes() == 2);
+    }
+    CHECK(v.size() == sizeof(nal) && memcmp(v.data(), nal, sizeof(nal)) == 0);
+
+    QBitstream r(&v, BS_INPUT);
+    r.setEmulationPrevention(true);
+    bool same = true;
+    for (uint8_t b : rbsp) same &= r.getbits(8) == b;
+    CHECK(same);
+    CHECK(r.epbytes() == 2);
+    CHECK(r.rawpos(3 * 8) == 4);
+    CHECK(r.rawpos(6 * 8) == 8);
+}
+
+// zero runs across many buffer flushes and refills come back unchanged
+static void round_trip()
+{
+    std::vector<uint8_t> rbsp;
+    uint32_t x = 1;
+    for (int i = 0; i < 20000; i++)
+    {
+        x = x * 1103515245 + 12345;
+        rbsp.push_back((x >> 16) % 3 ? 0 : (x >> 24) & 3);
+    }
+
+    flavor::SmallVector<uint8_t> v;
+    {
+        QBitstream w(&v, BS_OUTPUT, false, 64);
+        w.setEmulationPrevention(true);
+        for (uint8_t b : rbsp) w.putbits(b, 8);
+        w.flushbits();
+        CHECK(v.size() == rbsp.size() + w.epbytes());
+    }
+
+    // no three byte sequence 00 00 0x (x <= 3) is left in the escaped data
+    bool clean = true;
+    for (size_t i = 2; i < v.size(); i++) clean &= !(v[i - 2] == 0 && v[i - 1] == 0 && v[i] < 3);
+    for (size_t i = 3; i < v.size(); i++) clean &= !(v[i - 3] == 0 && v[i - 2] == 0 && v[i - 1] == 3 && v[i] > 3);
+    CHECK(clean);
+
+    QBitstream r(&v, BS_INPUT);
+    r.setEmulationPrevention(true);
+    bool same = true;
+    for (uint8_t b : rbsp) same &= r.getbits(8) == b;
+    CHECK(same);
+    CHECK(r.geterror() == E_NONE);
+}
+
+int main()
+{
+    known_bytes();
+    round_trip();
+    printf(fails ? "FAILED\n" : "OK\n");
+    return fails != 0;
+}
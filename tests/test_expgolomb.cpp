@@ -0,0 +1,31 @@
+// Exp-Golomb reads
+#include <stdio.h>
+#include <vector>
+
+#include <flavor.h>
+
+static int fails = 0;
+#define CHECK(c) do { if (!(c)) { fails++; printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #c); } } while (0)
+
+// codes with more leading zeros than allowed end the batch, rather than stalling it
+static void too_many_zeros()
+{
+    std::vector<uint8_t> data(64, 0x11);    // 000 1 0001 ...: every code has 3 leading zeros
+    flavor::SmallVector<uint8_t> v(data.begin(), data.end());
+    QBitstream bs(&v, BS_INPUT);
+    uint32_t out[10];
+
+    CHECK(bs.getbits_expgolomb_array(10, out, 2) == 0);
+    CHECK(bs.getpos() == 0);
+
+    // and the same codes read fine when they are allowed
+    CHECK(bs.getbits_expgolomb_array(10, out, 3) == 10);
+    CHECK(out[0] == 0x8 - 1);
+}
+
+int main()
+{
+    too_many_zeros();
+    printf(fails ? "FAILED\n" : "OK\n");
+    return fails != 0;
+}
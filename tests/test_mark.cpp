@@ -0,0 +1,84 @@
+// Speculative parsing with marks
+#include <stdio.h>
+#include <string>
+#include <sstream>
+
+#include <flavor.h>
+
+static int fails = 0;
+#define CHECK(c) do { if (!(c)) { fails++; printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #c); } } while (0)
+
+static std::string data()
+{
+    std::string d;
+    for (int i = 0; i < 5000; i++) d.push_back((char)(i * 7 + (i >> 8)));
+    return d;
+}
+
+// a rewind over several buffer refills reads the same bits again
+static void rewind_past_buffer()
+{
+    std::string d = data();
+    std::istringstream is(d);
+    QBitstream bs(&is, false, 64);
+
+    bs.getbits(5);
+    QBitstream::Mark m = bs.mark();
+    uint64_t first = 0;
+    for (int i = 0; i < 300; i++) first = first * 31 + bs.getbits(13);
+    CHECK(bs.getpos() == 5 + 300 * 13);
+
+    CHECK(bs.rewind(m));
+    CHECK(bs.getpos() == 5);
+    uint64_t again = 0;
+    for (int i = 0; i < 300; i++) again = again * 31 + bs.getbits(13);
+    CHECK(again == first);
+    bs.unmark(m);
+    CHECK(bs.geterror() == E_NONE);
+}
+
+// each mark is kept on its own: letting go of the older one keeps the newer one
+static void two_marks()
+{
+    std::string d = data();
+    std::istringstream is(d);
+    QBitstream bs(&is, false, 64);
+
+    QBitstream::Mark a = bs.mark();
+    bs.getbits(8);
+    QBitstream::Mark b = bs.mark();
+    bs.skipbits(8 * 500);
+    bs.unmark(a);
+
+    CHECK(bs.rewind(b));
+    CHECK(bs.getpos() == 8);
+    CHECK(bs.getbits(8) == (uint8_t)d[1]);
+    bs.unmark(b);
+}
+
+// getBuffer() keeps a mark made before it
+static void get_buffer()
+{
+    std::string d = data();
+    std::istringstream is(d);
+    QBitstream bs(&is, false, 64);
+
+    bs.getbits(16);
+    QBitstream::Mark m = bs.mark();
+    uint8_t out[1000];
+    CHECK(bs.getBuffer(out, sizeof(out)) == sizeof(out));
+    CHECK(out[0] == (uint8_t)d[2]);
+
+    CHECK(bs.rewind(m));
+    CHECK(bs.getbits(8) == (uint8_t)d[2]);
+    bs.unmark(m);
+}
+
+int main()
+{
+    rewind_past_buffer();
+    two_marks();
+    get_buffer();
+    printf(fails ? "FAILED\n" : "OK\n");
+    return fails != 0;
+}
@@ -0,0 +1,62 @@
+// VLC table decoding
+#include <stdio.h>
+
+#include <flavor.h>
+
+static int fails = 0;
+#define CHECK(c) do { if (!(c)) { fails++; printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #c); } } while (0)
+
+// a table that was never built, or whose build failed, decodes nothing
+static void empty_table()
+{
+    flavor::SmallVector<uint8_t> v(16, 0xa5);
+    QBitstream bs(&v, BS_INPUT);
+
+    flavor::VLCTable t;
+    CHECK(t.decode(bs) == -1);
+
+    // 0 and 01 are not prefix free
+    uint32_t codes[] = {0, 1};
+    uint8_t lens[] = {1, 2};
+    CHECK(!t.build(2, codes, lens));
+    CHECK(t.maxlen() == 0);
+    CHECK(t.decode(bs) == -1);
+    CHECK(bs.getpos() == 0);
+
+    // and a good build after that works
+    uint32_t good[] = {1, 0};
+    CHECK(t.build(2, good, lens));
+    CHECK(t.decode(bs) == 0);       // 1...
+    CHECK(bs.getpos() == 1);
+}
+
+// a length over 32 empties a table that was built before
+static void long_code()
+{
+    flavor::SmallVector<uint8_t> v(16, 0xa5);
+    QBitstream bs(&v, BS_INPUT);
+
+    flavor::VLCTable t;
+    uint32_t codes[] = {1, 0};
+    uint8_t lens[] = {1, 2};
+    CHECK(t.build(2, codes, lens));
+
+    uint8_t bad[] = {1, 33};
+    CHECK(!t.build(2, codes, bad));
+    CHECK(t.maxlen() == 0);
+    CHECK(t.decode(bs) == -1);
+
+    CHECK(t.build_canonical(2, lens));
+    CHECK(!t.build_canonical(2, bad));
+    CHECK(t.maxlen() == 0);
+    CHECK(t.decode(bs) == -1);
+    CHECK(bs.getpos() == 0);
+}
+
+int main()
+{
+    empty_table();
+    long_code();
+    printf(fails ? "FAILED\n" : "OK\n");
+    return fails != 0;
+}
@@ -0,0 +1,138 @@
+// VLC table implementation
+#include <algorithm>
+
+#include "fvlc.h"
+
+namespace flavor {
+
+bool VLCTable::build(int n, const uint32_t * codes, const uint8_t * lens, const int32_t * syms, int bits)
+{
+    clear();
+    _codes.clear();
+    for (int i = 0; i < n; i++)
+    {
+        if (!lens[i]) continue;
+        if (lens[i] > 32) return false;
+
+        Code c;
+        c.code = codes[i] << (32 - lens[i]);
+        c.len = lens[i];
+        c.sym = syms ? syms[i] : i;
+        _codes.push_back(c);
+    }
+    return build_sorted(bits);
+}
+
+bool VLCTable::build_canonical(int n, const uint8_t * lens, const int32_t * syms, int bits)
+{
+    int count[33] = {0};
+    uint32_t next[33];
+
+    clear();
+    for (int i = 0; i < n; i++)
+    {
+        if (lens[i] > 32) return false;
+        count[lens[i]]++;
+    }
+
+    // first code of each length
+    uint32_t code = 0;
+    count[0] = 0;
+    for (int l = 1; l <= 32; l++)
+    {
+        code = (code + count[l - 1]) << 1;
+        next[l] = code;
+    }
+
+    _codes.clear();
+    for (int i = 0; i < n; i++)
+    {
+        if (!lens[i]) continue;
+
+        Code c;
+        c.code = next[lens[i]]++ << (32 - lens[i]);
+        c.len = lens[i];
+        c.sym = syms ? syms[i] : i;
+        _codes.push_back(c);
+    }
+    return build_sorted(bits);
+}
+
+void VLCTable::clear()
+{
+    _table.clear();
+    _maxlen = 0;
+    _bits = 0;
+}
+
+bool VLCTable::build_sorted(int bits)
+{
+    clear();
+    if (_codes.empty()) return false;
+
+    // codes with a common prefix become neighbours
+    std::sort(_codes.begin(), _codes.end(), [](const Code & a, const Code & b) {
+        return a.code != b.code ? a.code < b.code : a.len < b.len;
+    });
+
+    for (const Code & c : _codes) _maxlen = std::max(_maxlen, (int)c.len);
+    _bits = std::max(1, std::min(bits, _maxlen));
+
+    if (build_level(_codes.data(), (int)_codes.size(), _bits, 0) == 0) return true;
+
+    // a failed build leaves an empty table, which decodes nothing
+    _table.clear();
+    _maxlen = 0;
+    return false;
+}
+
+int VLCTable::build_level(const Code * c, int n, int nbits, int consumed)
+{
+    int off = (int)_table.size();
+    Entry empty = {0, 0};
+
+    _table.append((size_t)1 << nbits, empty);
+
+    for (int i = 0; i < n; )
+    {
+        uint32_t v = c[i].code << consumed;     // the bits left for this level, left adjusted
+        int r = c[i].len - consumed;            // and their number
+        uint32_t idx = v >> (32 - nbits);
+
+        if (r <= nbits)
+        {
+            // a code that ends in this level fills every index it is a prefix of
+            for (uint32_t k = 0; k < ((uint32_t)1 << (nbits - r)); k++)
+            {
+                Entry & e = _table[off + idx + k];
+                if (e.len) return -1;
+                e.sym = c[i].sym;
+                e.len = r;
+            }
+            i++;
+            continue;
+        }
+
+        // the codes continuing with this index go to a sub-table deep enough for the longest
+        int j = i;
+        int sublen = 0;
+        while (j < n && (c[j].code << consumed) >> (32 - nbits) == idx)
+        {
+            if (c[j].len - consumed <= nbits) return -1;
+            sublen = std::max(sublen, c[j].len - consumed - nbits);
+            j++;
+        }
+        int subbits = std::min(sublen, _bits);
+
+        if (_table[off + idx].len) return -1;
+        int sub = build_level(c + i, j - i, subbits, consumed + nbits);
+        if (sub < 0) return -1;
+
+        _table[off + idx].sym = sub;
+        _table[off + idx].len = -subbits;
+        i = j;
+    }
+    return off;
+}
+
+} // namespace flavor